@@ -0,0 +1,35 @@
+#!/bin/bash
+
+# Read and write amplification over a grid of max node sizes (-N) and
+# min flush sizes (-f).  Each point starts from an empty tree, since
+# the test program recovers whatever tree it finds.  Combinations with
+# a flush size of more than a quarter of the node size are skipped.
+# Any arguments are passed on to the test program, e.g.
+#   bash ./AmplificationSweep.sh -t 100000 -k 50000 -v 256 -C 64
+
+NODE_SIZES=${NODE_SIZES:-"64 256 1024 4096"}
+FLUSH_SIZES=${FLUSH_SIZES:-"4 16 64 256"}
+
+LOGGING_FILE=kv_store.log
+CHECKPOINT_POSITION_FILE=version_map.bin
+TREE_DIRECTORY=tmpdir
+
+echo "# max_node_size min_flush_size write_amplification read_amplification"
+for N in $NODE_SIZES; do
+    for F in $FLUSH_SIZES; do
+        if [ $((F * 4)) -gt $N ]; then
+            continue
+        fi
+        mkdir -p $TREE_DIRECTORY
+        rm -f $TREE_DIRECTORY/*
+        rm -f $LOGGING_FILE $LOGGING_FILE.* $CHECKPOINT_POSITION_FILE
+        touch $LOGGING_FILE $CHECKPOINT_POSITION_FILE
+        RESULT=$(./test -d $TREE_DIRECTORY -m benchmark-amplification -N $N -f $F "$@" |
+                 grep "^# amplification")
+        if [ -z "$RESULT" ]; then
+            echo "N=$N f=$F failed" >&2
+            exit 1
+        fi
+        echo "$RESULT" | sed 's/^# amplification \([0-9]*\) \([0-9]*\): /\1 \2 /'
+    done
+done
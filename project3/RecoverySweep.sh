@@ -0,0 +1,44 @@
+#!/bin/bash
+
+# Checkpoint cost and recovery time over a grid of checkpoint (-c) and
+# persistence (-p) granularities, using test_logging_restore's
+# benchmark-restart mode.  Each point starts from an empty tree.  Any
+# arguments are passed on to the test program, e.g.
+#   bash ./RecoverySweep.sh -k 100000 -t 100000 -a 1000 -C 64 -F
+# Times are in microseconds.
+
+CHECKPOINT_GRANULARITIES=${CHECKPOINT_GRANULARITIES:-"1000 10000 100000"}
+PERSISTENCE_GRANULARITIES=${PERSISTENCE_GRANULARITIES:-"1 10 100"}
+
+LOGGING_FILE=kv_store.log
+CHECKPOINT_POSITION_FILE=version_map.bin
+TREE_DIRECTORY=tmpdir
+
+# Fields of a "# <name>: ..." line, after the name
+field() {
+    echo "$1" | grep "^# $2:" | sed "s/^# $2: //" | cut -d' ' -f$3
+}
+
+echo "# c p checkpoints stall_p99 stall_max duration_mean recovery log_read replay records_replayed"
+for C in $CHECKPOINT_GRANULARITIES; do
+    for P in $PERSISTENCE_GRANULARITIES; do
+        mkdir -p $TREE_DIRECTORY
+        rm -f $TREE_DIRECTORY/*
+        rm -f $LOGGING_FILE $LOGGING_FILE.* $CHECKPOINT_POSITION_FILE
+        touch $LOGGING_FILE $CHECKPOINT_POSITION_FILE
+        OUTPUT=$(./test_logging_restore -d $TREE_DIRECTORY -m benchmark-restart -c $C -p $P "$@")
+        if ! echo "$OUTPUT" | grep -q "^# recovery:"; then
+            echo "c=$C p=$P failed" >&2
+            exit 1
+        fi
+        echo "$C $P" \
+             "$(field "$OUTPUT" checkpoints 1)" \
+             "$(field "$OUTPUT" "checkpoint stall" 3)" \
+             "$(field "$OUTPUT" "checkpoint stall" 4)" \
+             "$(field "$OUTPUT" "checkpoint duration" 5)" \
+             "$(field "$OUTPUT" recovery 1)" \
+             "$(field "$OUTPUT" recovery 5)" \
+             "$(field "$OUTPUT" recovery 6)" \
+             "$(field "$OUTPUT" replayed 2)"
+    done
+done
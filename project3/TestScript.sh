@@ -3,7 +3,7 @@
 # STUDENT PARAMETERS
 # change where your logging file is so it can be deleted
 LOGGING_FILE=kv_store.log
-CHECKPOINT_POSITION_FILE=version_map.txt
+CHECKPOINT_POSITION_FILE=version_map.bin
 
 ## GLOBAL PARAMETERS
 TREE_DIRECTORY=tmpdir
@@ -0,0 +1,34 @@
+#!/bin/bash
+
+# Randomized test of value log garbage collection.  Every value is
+# separated (-V 1) into small segments (-G), checkpoints are frequent
+# (-c) so a segment is collected at almost every one, and the trees are
+# small and deep, so updates are often buffered between an insert deep
+# in the tree and a newer insert of the same key above it.  Each run
+# starts from an empty tree.  Any arguments are passed on to the test
+# program, e.g.
+#   bash ./ValueLogTest.sh -F
+
+SEEDS=${SEEDS:-"1 2 3"}
+SHAPES=${SHAPES:-"-k:300:-N:8:-f:1 -k:1000:-N:16:-f:2 -k:200:-N:12:-f:2:-M"}
+
+LOGGING_FILE=kv_store.log
+CHECKPOINT_POSITION_FILE=version_map.bin
+TREE_DIRECTORY=tmpdir
+
+FAILED=0
+for SHAPE in $SHAPES; do
+    for SEED in $SEEDS; do
+        mkdir -p $TREE_DIRECTORY
+        rm -f $TREE_DIRECTORY/*
+        rm -f $LOGGING_FILE $LOGGING_FILE.* $CHECKPOINT_POSITION_FILE
+        touch $LOGGING_FILE $CHECKPOINT_POSITION_FILE
+        RESULT=$(./test -d $TREE_DIRECTORY -m test-value-log -v 500 -t 20000 -s $SEED \
+                        -V 1 -G 4096 -C 8 -c 20 ${SHAPE//:/ } "$@" 2>&1 | tail -1)
+        echo "${SHAPE//:/ } -s $SEED: $RESULT"
+        if [ "$RESULT" != "Test PASSED" ]; then
+            FAILED=1
+        fi
+    done
+done
+exit $FAILED
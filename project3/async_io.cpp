@@ -0,0 +1,331 @@
+#include "async_io.hpp"
+#include "background_worker.hpp"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#define MAX_ASYNC_IO_THREADS (8)
+
+//////////////////////////////////////////////////////////
+// io_uring, driven through the raw system call interface //
+//////////////////////////////////////////////////////////
+class io_uring_async_io : public async_io {
+public:
+  io_uring_async_io(void) :
+    ring_fd(-1),
+    in_flight(0),
+    unsubmitted(0)
+  {}
+
+  ~io_uring_async_io(void) {
+    if (ring_fd < 0)
+      return;
+    complete();
+    munmap(sqes, sqes_size);
+    if (cq_ring != sq_ring)
+      munmap(cq_ring, cq_ring_size);
+    munmap(sq_ring, sq_ring_size);
+    close(ring_fd);
+  }
+
+  // Returns false if the kernel has no io_uring, or one without the
+  // operations used here (READ and WRITE came after io_uring itself).
+  bool setup(unsigned depth) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring_fd = syscall(__NR_io_uring_setup, depth, &params);
+    if (ring_fd < 0)
+      return false;
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+      sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ring_fd, IORING_OFF_SQ_RING);
+    cq_ring = sq_ring;
+    if (sq_ring != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP))
+      cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring_fd, IORING_OFF_CQ_RING);
+    sqes = (struct io_uring_sqe *)mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+                                       MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+      close(ring_fd);
+      ring_fd = -1;
+      return false;
+    }
+
+    char *sq = (char *)sq_ring;
+    sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    sq_array = (unsigned *)(sq + params.sq_off.array);
+    sq_entries = params.sq_entries;
+    char *cq = (char *)cq_ring;
+    cq_head = (unsigned *)(cq + params.cq_off.head);
+    cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return supports_operations();
+  }
+
+  // A write with sync is two linked entries (write, then fsync) that
+  // share one request.  One that truncates is just the write; the
+  // truncate and the fsync follow once it completes (see submit()).
+  void pwrite(int fd, const char *buf, size_t len, off_t offset, bool sync, callback done,
+              off_t truncate) {
+    bool linked = sync && truncate < 0;
+    request *req = new request(done, linked ? 2 : 1);
+    req->fd = fd;
+    req->sync = sync;
+    req->truncate = truncate;
+    make_room(linked ? 2 : 1);
+    struct io_uring_sqe *sqe = next_sqe(IORING_OP_WRITE, fd, req);
+    sqe->addr = (uint64_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    if (linked) {
+      sqe->flags |= IOSQE_IO_LINK;
+      next_sqe(IORING_OP_FSYNC, fd, req);
+    }
+    submit(0);
+  }
+
+  void pread(int fd, char *buf, size_t len, off_t offset, callback done) {
+    request *req = new request(done, 1);
+    make_room(1);
+    struct io_uring_sqe *sqe = next_sqe(IORING_OP_READ, fd, req);
+    sqe->addr = (uint64_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    submit(0);
+  }
+
+  void complete(void) {
+    while (in_flight > 0)
+      submit(1);
+  }
+
+private:
+  struct request {
+    request(callback done, int entries) :
+      done(done),
+      entries(entries),
+      result(0),
+      first(true),
+      fd(-1),
+      sync(false),
+      truncate(-1)
+    {}
+    callback done;
+    int entries;
+    ssize_t result;
+    bool first;
+    int fd;
+    bool sync;
+    off_t truncate;  // Still to be done once the write completes
+  };
+
+  bool supports_operations(void) {
+    std::vector<char> buffer(sizeof(struct io_uring_probe) +
+                             256 * sizeof(struct io_uring_probe_op), 0);
+    struct io_uring_probe *probe = (struct io_uring_probe *)&buffer[0];
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+      return false;
+    const uint8_t needed[] = { IORING_OP_READ, IORING_OP_WRITE, IORING_OP_FSYNC };
+    for (uint8_t op : needed)
+      if (op >= probe->ops_len || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+        return false;
+    return true;
+  }
+
+  // Reap completions until n more entries fit in the ring.
+  void make_room(unsigned n) {
+    while (in_flight + n > sq_entries)
+      submit(1);
+  }
+
+  struct io_uring_sqe * next_sqe(uint8_t opcode, int fd, request *req) {
+    unsigned tail = *sq_tail;
+    unsigned index = tail & sq_mask;
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = (uint64_t)req;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    in_flight++;
+    unsubmitted++;
+    return sqe;
+  }
+
+  // Hand queued entries to the kernel, wait for at least
+  // min_complete completions, and run the callbacks of finished
+  // requests.
+  void submit(unsigned min_complete) {
+    if (unsubmitted > 0 || min_complete > 0) {
+      int ret = syscall(__NR_io_uring_enter, ring_fd, unsubmitted, min_complete,
+                        min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+      if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        throw std::runtime_error(std::string("io_uring_enter failed: ") + strerror(errno));
+      if (ret > 0)
+        unsubmitted -= std::min<unsigned>(ret, unsubmitted);
+    }
+
+    std::vector<request *> truncating;
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+      struct io_uring_cqe *cqe = &cqes[head & cq_mask];
+      request *req = (request *)cqe->user_data;
+      // The first entry is the transfer; a failed fsync after it
+      // overrides its byte count.
+      if (req->first || (cqe->res < 0 && cqe->res != -ECANCELED))
+        req->result = cqe->res;
+      req->first = false;
+      head++;
+      in_flight--;
+      if (--req->entries == 0 && req->truncate >= 0 && req->result >= 0) {
+        truncating.push_back(req);
+      } else if (req->entries == 0) {
+        req->done(req->result);
+        delete req;
+      }
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+    // The ring has no portable truncate, so that one step runs here;
+    // the fsync after it goes back through the ring.
+    for (request *req : truncating) {
+      if (ftruncate(req->fd, req->truncate) != 0)
+        req->result = -errno;
+      req->truncate = -1;
+      if (req->result < 0 || !req->sync) {
+        req->done(req->result);
+        delete req;
+        continue;
+      }
+      make_room(1);
+      req->entries = 1;
+      next_sqe(IORING_OP_FSYNC, req->fd, req);
+    }
+  }
+
+  int ring_fd;
+  void *sq_ring;
+  void *cq_ring;
+  size_t sq_ring_size;
+  size_t cq_ring_size;
+  size_t sqes_size;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned *sq_array;
+  unsigned sq_entries;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned in_flight;
+  unsigned unsubmitted;
+};
+
+//////////////////////////////////////////////////////////////
+// Fallback: blocking system calls on a few background threads //
+//////////////////////////////////////////////////////////////
+class thread_pool_async_io : public async_io {
+public:
+  thread_pool_async_io(unsigned depth, unsigned nthreads) :
+    depth(depth),
+    next_worker(0)
+  {
+    for (unsigned i = 0; i < nthreads; i++)
+      workers.push_back(std::unique_ptr<background_worker>(new background_worker));
+  }
+
+  ~thread_pool_async_io(void) {
+    complete();
+  }
+
+  void pwrite(int fd, const char *buf, size_t len, off_t offset, bool sync, callback done,
+              off_t truncate) {
+    request *req = queue(done);
+    next()->submit([=] {
+      req->result = ::pwrite(fd, buf, len, offset);
+      if (req->result < 0)
+        req->result = -errno;
+      else if (truncate >= 0 && ftruncate(fd, truncate) != 0)
+        req->result = -errno;
+      else if (sync && fsync(fd) != 0)
+        req->result = -errno;
+    });
+  }
+
+  void pread(int fd, char *buf, size_t len, off_t offset, callback done) {
+    request *req = queue(done);
+    next()->submit([=] {
+      req->result = ::pread(fd, buf, len, offset);
+      if (req->result < 0)
+        req->result = -errno;
+    });
+  }
+
+  void complete(void) {
+    for (auto &worker : workers)
+      worker->drain();
+    for (request *req : requests) {
+      req->done(req->result);
+      delete req;
+    }
+    requests.clear();
+  }
+
+private:
+  struct request {
+    request(callback done) :
+      done(done),
+      result(0)
+    {}
+    callback done;
+    ssize_t result;
+  };
+
+  // Callbacks only run in complete(), so that is also how room is
+  // made for more than depth requests.
+  request * queue(callback done) {
+    if (requests.size() >= depth)
+      complete();
+    request *req = new request(done);
+    requests.push_back(req);
+    return req;
+  }
+
+  background_worker * next(void) {
+    return workers[next_worker++ % workers.size()].get();
+  }
+
+  const unsigned depth;
+  std::vector<std::unique_ptr<background_worker> > workers;
+  unsigned next_worker;
+  std::vector<request *> requests;
+};
+
+async_io * async_io::create(unsigned depth, bool use_io_uring)
+{
+  if (use_io_uring) {
+    io_uring_async_io *io = new io_uring_async_io;
+    if (io->setup(depth))
+      return io;
+    delete io;
+  }
+  return new thread_pool_async_io(depth, std::min(depth, (unsigned)MAX_ASYNC_IO_THREADS));
+}
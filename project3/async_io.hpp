@@ -0,0 +1,39 @@
+// Asynchronous reads and writes on file descriptors, with completion
+// callbacks.  Used by the backing store to keep many node images in
+// flight at once.  Requests start as soon as they are queued;
+// complete() waits for all of them and runs their callbacks on the
+// calling thread.
+//
+// create() uses io_uring when the kernel provides it along with the
+// operations used here, and falls back to a pool of
+// background_workers otherwise.  An async_io is not thread-safe.
+
+#ifndef ASYNC_IO_HPP
+#define ASYNC_IO_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <sys/types.h>
+
+class async_io {
+public:
+  // done gets the number of bytes transferred, or -errno.
+  typedef std::function<void(ssize_t)> callback;
+
+  virtual ~async_io(void) {}
+
+  // With truncate >= 0 the file is cut to that length after the
+  // write, for writes padded to whole blocks.  With sync, the file is
+  // then fsynced before done runs.
+  virtual void pwrite(int fd, const char *buf, size_t len, off_t offset,
+                      bool sync, callback done, off_t truncate = -1) = 0;
+  virtual void pread(int fd, char *buf, size_t len, off_t offset,
+                     callback done) = 0;
+  virtual void complete(void) = 0;
+
+  // depth bounds the number of requests in flight.
+  static async_io * create(unsigned depth, bool use_io_uring = true);
+};
+
+#endif // ASYNC_IO_HPP
@@ -0,0 +1,78 @@
+// A single background thread that runs queued jobs in FIFO order.
+// Used by the swap_space to move checkpoint I/O off the write path.
+
+#ifndef BACKGROUND_WORKER_HPP
+#define BACKGROUND_WORKER_HPP
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+class background_worker {
+public:
+  background_worker(void) :
+    busy(false),
+    stopping(false),
+    thread(&background_worker::run, this)
+  {}
+
+  ~background_worker(void) {
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      stopping = true;
+    }
+    wakeup.notify_all();
+    thread.join();
+  }
+
+  void submit(std::function<void(void)> job) {
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      jobs.push_back(job);
+    }
+    wakeup.notify_all();
+  }
+
+  // True if a job is queued or running.
+  bool is_busy(void) {
+    std::unique_lock<std::mutex> lock(mtx);
+    return busy || !jobs.empty();
+  }
+
+  // Block until every submitted job has finished.
+  void drain(void) {
+    std::unique_lock<std::mutex> lock(mtx);
+    idle.wait(lock, [this] { return !busy && jobs.empty(); });
+  }
+
+private:
+  void run(void) {
+    std::unique_lock<std::mutex> lock(mtx);
+    while (true) {
+      wakeup.wait(lock, [this] { return stopping || !jobs.empty(); });
+      if (jobs.empty())
+        break;
+      std::function<void(void)> job = jobs.front();
+      jobs.pop_front();
+      busy = true;
+      lock.unlock();
+      job();
+      lock.lock();
+      busy = false;
+      if (jobs.empty())
+        idle.notify_all();
+    }
+  }
+
+  std::mutex mtx;
+  std::condition_variable wakeup;
+  std::condition_variable idle;
+  std::deque<std::function<void(void)> > jobs;
+  bool busy;
+  bool stopping;
+  std::thread thread;
+};
+
+#endif // BACKGROUND_WORKER_HPP
@@ -1,14 +1,209 @@
 #include "backing_store.hpp"
+#include "async_io.hpp"
+#include "compression.hpp"
+#include "latency_histogram.hpp"
 #include <iostream>
 #include <ext/stdio_filebuf.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <cctype>
+#include <cstdlib>
 #include <cassert>
+#include <cstring>
+#include <sstream>
+#include <algorithm>
+#include <memory>
+#include <deque>
+#include <ctime>
+#include <stdexcept>
+
+#define DIRECT_IO_BLOCK_SIZE (4096)
+#define MAX_FREE_DIRECT_IO_BUFFERS (16)
+#define ASYNC_IO_DEPTH (64)
+
+void backing_store::write(uint64_t obj_id, uint64_t version, const std::string &buffer)
+{
+  std::string scratch;
+  const std::string &bytes = encode_image(buffer, scratch);
+  put_image(obj_id, version, bytes);
+  io_counters.add(IO_WRITES);
+  io_counters.add(IO_BYTES_WRITTEN, bytes.size());
+}
+
+void backing_store::read(uint64_t obj_id, uint64_t version, std::string &buffer)
+{
+  get_image(obj_id, version, buffer);
+  io_counters.add(IO_READS);
+  io_counters.add(IO_BYTES_READ, buffer.size());
+  decode_image(buffer);
+}
+
+void backing_store::put_image(uint64_t obj_id, uint64_t version, const std::string &bytes)
+{
+  allocate(obj_id, version);
+  std::iostream *out = get(obj_id, version);
+  out->write(bytes.data(), bytes.length());
+  put(out);
+}
+
+void backing_store::get_image(uint64_t obj_id, uint64_t version, std::string &bytes)
+{
+  std::iostream *in = get(obj_id, version);
+  in->exceptions(std::iostream::badbit);
+  std::stringstream contents;
+  contents << in->rdbuf();
+  bytes = contents.str();
+  put(in);
+}
+
+void backing_store::set_compression(bool compress)
+{
+  this->compress = compress;
+}
+
+const std::string & backing_store::encode_image(const std::string &buffer, std::string &scratch)
+{
+  if (!compress)
+    return buffer;
+  scratch = encode_node_image(buffer);
+  images_written++;
+  raw_bytes += buffer.size();
+  stored_bytes += scratch.size();
+  return scratch;
+}
+
+bool backing_store::decode_image(const char *data, size_t size, std::string &out)
+{
+  if (!is_encoded_node_image(data, size))
+    return false;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  bool ok = decode_node_image(data, size, out);
+  assert(ok);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  images_decoded++;
+  decode_ns += (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+  return true;
+}
+
+void backing_store::decode_image(std::string &bytes)
+{
+  std::string raw;
+  if (decode_image(bytes.data(), bytes.size(), raw))
+    bytes.swap(raw);
+}
+
+backing_store::compression_stats backing_store::get_compression_stats(void) const
+{
+  compression_stats stats;
+  stats.images_written = images_written;
+  stats.raw_bytes = raw_bytes;
+  stats.stored_bytes = stored_bytes;
+  stats.images_decoded = images_decoded;
+  stats.decode_ns = decode_ns;
+  return stats;
+}
+
+backing_store::io_stats backing_store::get_io_stats(void) const
+{
+  io_stats stats;
+  stats.reads = io_counters.get(IO_READS);
+  stats.bytes_read = io_counters.get(IO_BYTES_READ);
+  stats.writes = io_counters.get(IO_WRITES);
+  stats.bytes_written = io_counters.get(IO_BYTES_WRITTEN);
+  stats.fsyncs = io_counters.get(IO_FSYNCS);
+  stats.maps = io_counters.get(IO_MAPS);
+  stats.bytes_mapped = io_counters.get(IO_BYTES_MAPPED);
+  stats.deallocations = io_counters.get(IO_DEALLOCATIONS);
+  return stats;
+}
+
+class synchronous_io_batch : public io_batch {
+public:
+  synchronous_io_batch(backing_store &store) :
+    store(store)
+  {}
+  void write(uint64_t obj_id, uint64_t version, const std::string &buffer) {
+    store.write(obj_id, version, buffer);
+  }
+  void read(uint64_t obj_id, uint64_t version, std::string &buffer) {
+    store.read(obj_id, version, buffer);
+  }
+  void complete(void) {}
+
+private:
+  backing_store &store;
+};
+
+io_batch * backing_store::begin_batch(void)
+{
+  return new synchronous_io_batch(*this);
+}
+
+/////////////////////////////////////////
+// Implementation of aligned_buffer_pool //
+/////////////////////////////////////////
+aligned_buffer_pool::aligned_buffer_pool(size_t block_size, size_t max_free_per_size)
+  : block_size(block_size),
+    max_free_per_size(max_free_per_size)
+{}
+
+aligned_buffer_pool::~aligned_buffer_pool(void)
+{
+  for (auto &size : free_buffers)
+    for (char *buffer : size.second)
+      free(buffer);
+}
+
+size_t aligned_buffer_pool::round_up(size_t size) const
+{
+  return (size + block_size - 1) / block_size * block_size;
+}
+
+//return a block-aligned buffer of at least size bytes
+char * aligned_buffer_pool::get(size_t size, size_t &capacity)
+{
+  capacity = std::max(round_up(size), block_size);
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    auto it = free_buffers.find(capacity);
+    if (it != free_buffers.end() && !it->second.empty()) {
+      char *buffer = it->second.back();
+      it->second.pop_back();
+      return buffer;
+    }
+  }
+  void *buffer;
+  if (posix_memalign(&buffer, block_size, capacity) != 0)
+    throw std::bad_alloc();
+  return (char *)buffer;
+}
+
+void aligned_buffer_pool::put(char *buffer, size_t capacity)
+{
+  std::unique_lock<std::mutex> guard(lock);
+  std::vector<char *> &buffers = free_buffers[capacity];
+  if (buffers.size() < max_free_per_size)
+    buffers.push_back(buffer);
+  else
+    free(buffer);
+}
 
 /////////////////////////////////////////////////////////////
 // Implementation of the one_file_per_object_backing_store //
 /////////////////////////////////////////////////////////////
-one_file_per_object_backing_store::one_file_per_object_backing_store(std::string rt)
-  : root(rt)
+one_file_per_object_backing_store::one_file_per_object_backing_store(std::string rt, bool direct_io,
+                                                                     bool use_io_uring)
+  : root(rt),
+    direct_io(direct_io && supports_direct_io(rt)),
+    buffers(DIRECT_IO_BLOCK_SIZE, MAX_FREE_DIRECT_IO_BUFFERS),
+    io(async_io::create(ASYNC_IO_DEPTH, use_io_uring))
+{}
+
+one_file_per_object_backing_store::~one_file_per_object_backing_store(void)
 {}
 
 //allocate space for a new version of an object
@@ -27,6 +222,7 @@ void one_file_per_object_backing_store::allocate(uint64_t obj_id, uint64_t versi
 //delete the file associated with an specific version of a node
 void one_file_per_object_backing_store::deallocate(uint64_t obj_id, uint64_t version) {
     std::string filename = get_filename(obj_id, version);
+    io_counters.add(IO_DEALLOCATIONS);
     if (unlink(filename.c_str()) != 0) {
         if (errno == ENOENT) {
             // std::cerr << "Warning: File not found for deletion: " << filename << std::endl;
@@ -59,10 +255,279 @@ void one_file_per_object_backing_store::put(std::iostream *ios)
   ios->flush();
   __gnu_cxx::stdio_filebuf<char> *fb = (__gnu_cxx::stdio_filebuf<char> *)ios->rdbuf();
   fsync(fb->fd());
+  io_counters.add(IO_FSYNCS);
   delete ios;
   delete fb;
 }
 
+//try O_DIRECT on a scratch file in root.  Only a successful open
+//counts as support; any failure means buffered I/O for good.
+bool one_file_per_object_backing_store::supports_direct_io(const std::string &root)
+{
+  std::string filename = root + "/direct_io_probe";
+  int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_DIRECT, 0644);
+  if (fd < 0) {
+    std::cerr << "Warning: O_DIRECT probe in " << root << " failed ("
+              << strerror(errno) << "), using buffered I/O" << std::endl;
+    return false;
+  }
+  close(fd);
+  unlink(filename.c_str());
+  return true;
+}
+
+int one_file_per_object_backing_store::open_direct(const std::string &filename, int flags)
+{
+  return open(filename.c_str(), flags | O_DIRECT, 0644);
+}
+
+//write a whole image.  Direct writes go through a pooled aligned
+//buffer padded to the block size; the file is then cut back to the
+//image's length.
+void one_file_per_object_backing_store::put_image(uint64_t obj_id, uint64_t version, const std::string &buffer)
+{
+  if (!direct_io) {
+    backing_store::put_image(obj_id, version, buffer);
+    return;
+  }
+  std::string filename = get_filename(obj_id, version);
+  int fd = open_direct(filename, O_WRONLY | O_CREAT | O_TRUNC);
+  assert(fd >= 0);
+  size_t capacity;
+  char *aligned = buffers.get(buffer.size(), capacity);
+  memcpy(aligned, buffer.data(), buffer.size());
+  memset(aligned + buffer.size(), 0, capacity - buffer.size());
+  ssize_t written = pwrite(fd, aligned, capacity, 0);
+  buffers.put(aligned, capacity);
+  assert(written == (ssize_t)capacity);
+  int truncated = ftruncate(fd, buffer.size());
+  assert(truncated == 0);
+  fsync(fd);
+  io_counters.add(IO_FSYNCS);
+  close(fd);
+}
+
+void one_file_per_object_backing_store::get_image(uint64_t obj_id, uint64_t version, std::string &buffer)
+{
+  std::string filename = get_filename(obj_id, version);
+  int fd = -1;
+  if (direct_io)
+    fd = open_direct(filename, O_RDONLY);
+  else
+    fd = open(filename.c_str(), O_RDONLY);
+  assert(fd >= 0);
+  struct stat st;
+  int status = fstat(fd, &st);
+  assert(status == 0);
+  if (!direct_io) {
+    buffer.resize(st.st_size);
+    ssize_t nread = pread(fd, &buffer[0], st.st_size, 0);
+    assert(nread == st.st_size);
+    close(fd);
+    return;
+  }
+  size_t capacity;
+  char *aligned = buffers.get(st.st_size, capacity);
+  ssize_t nread = pread(fd, aligned, capacity, 0);
+  assert(nread == st.st_size);
+  buffer.assign(aligned, st.st_size);
+  buffers.put(aligned, capacity);
+  close(fd);
+}
+
+///////////////////////////////////////////////////////////////////
+// Batches for the one_file_per_object_backing_store: files are    //
+// opened synchronously, the transfers and fsyncs run on the       //
+// store's async_io.  complete() throws if any request failed.     //
+///////////////////////////////////////////////////////////////////
+class file_io_batch : public io_batch {
+public:
+  file_io_batch(one_file_per_object_backing_store &store) :
+    store(store),
+    lock(store.io_lock, std::defer_lock)
+  {}
+
+  // Only has requests in flight here when unwinding, so failures are
+  // not reported again.
+  ~file_io_batch(void) {
+    if (lock.owns_lock())
+      store.io->complete();
+  }
+
+  // Direct writes are padded to whole blocks, so the file is cut back
+  // to the image's length before it is synced.
+  void write(uint64_t obj_id, uint64_t version, const std::string &image) {
+    encoded.push_back(std::string());
+    const std::string &buffer = store.encode_image(image, encoded.back());
+    std::string filename = store.get_filename(obj_id, version);
+    bool direct = store.direct_io;
+    int fd = direct ? store.open_direct(filename, O_WRONLY | O_CREAT | O_TRUNC)
+                    : open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      fail("open", filename, -errno);
+      return;
+    }
+    store.io_counters.add(one_file_per_object_backing_store::IO_WRITES);
+    store.io_counters.add(one_file_per_object_backing_store::IO_BYTES_WRITTEN, buffer.size());
+    store.io_counters.add(one_file_per_object_backing_store::IO_FSYNCS);
+    begin();
+    file_io_batch *batch = this;
+    if (!direct) {
+      size_t length = buffer.size();
+      store.io->pwrite(fd, buffer.data(), length, 0, true, [=](ssize_t written) {
+        batch->check("write", filename, written, length);
+        close(fd);
+      });
+      return;
+    }
+    size_t capacity;
+    char *aligned = store.buffers.get(buffer.size(), capacity);
+    memcpy(aligned, buffer.data(), buffer.size());
+    memset(aligned + buffer.size(), 0, capacity - buffer.size());
+    size_t length = buffer.size();
+    aligned_buffer_pool *pool = &store.buffers;
+    store.io->pwrite(fd, aligned, capacity, 0, true, [=](ssize_t written) {
+      batch->check("write", filename, written, capacity);
+      pool->put(aligned, capacity);
+      close(fd);
+    }, length);
+  }
+
+  void read(uint64_t obj_id, uint64_t version, std::string &buffer) {
+    std::string filename = store.get_filename(obj_id, version);
+    bool direct = store.direct_io;
+    int fd = direct ? store.open_direct(filename, O_RDONLY) : open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      fail("open", filename, -errno);
+      if (fd >= 0)
+        close(fd);
+      return;
+    }
+    size_t length = st.st_size;
+    store.io_counters.add(one_file_per_object_backing_store::IO_READS);
+    store.io_counters.add(one_file_per_object_backing_store::IO_BYTES_READ, length);
+    begin();
+    file_io_batch *batch = this;
+    one_file_per_object_backing_store *s = &store;
+    std::string *out = &buffer;
+    if (!direct) {
+      buffer.resize(length);
+      store.io->pread(fd, &buffer[0], length, 0, [=](ssize_t nread) {
+        close(fd);
+        if (batch->check("read", filename, nread, length))
+          s->decode_image(*out);
+      });
+      return;
+    }
+    size_t capacity;
+    char *aligned = store.buffers.get(length, capacity);
+    store.io->pread(fd, aligned, capacity, 0, [=](ssize_t nread) {
+      bool ok = batch->check("read", filename, nread, length);
+      if (ok)
+        out->assign(aligned, length);
+      s->buffers.put(aligned, capacity);
+      close(fd);
+      if (ok)
+        s->decode_image(*out);
+    });
+  }
+
+  void complete(void) {
+    if (lock.owns_lock()) {
+      store.io->complete();
+      lock.unlock();
+    }
+    encoded.clear();
+    if (!error.empty()) {
+      std::string message;
+      message.swap(error);
+      throw std::runtime_error(message);
+    }
+  }
+
+private:
+  void begin(void) {
+    if (!lock.owns_lock())
+      lock.lock();
+  }
+
+  // Keeps the first failure for complete() to report.
+  void fail(const char *what, const std::string &filename, ssize_t result) {
+    if (error.empty())
+      error = std::string("Unable to ") + what + " " + filename + ": " +
+        (result < 0 ? strerror(-result) : "short transfer");
+  }
+
+  bool check(const char *what, const std::string &filename, ssize_t result, size_t expected) {
+    if (result == (ssize_t)expected)
+      return true;
+    fail(what, filename, result);
+    return false;
+  }
+
+  one_file_per_object_backing_store &store;
+  std::unique_lock<std::mutex> lock;  // On store.io_lock while requests are in flight
+  std::deque<std::string> encoded;  // Compressed images in flight
+  std::string error;
+};
+
+io_batch * one_file_per_object_backing_store::begin_batch(void)
+{
+  return new file_io_batch(*this);
+}
+
+//map a version's file read-only.  Fails for empty files, which mmap
+//does not allow.
+const char * one_file_per_object_backing_store::map(uint64_t obj_id, uint64_t version, size_t &size)
+{
+  if (direct_io)
+    return NULL;
+  std::string filename = get_filename(obj_id, version);
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  void *data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return NULL;
+  size = st.st_size;
+  io_counters.add(IO_MAPS);
+  io_counters.add(IO_BYTES_MAPPED, size);
+  return (const char *)data;
+}
+
+void one_file_per_object_backing_store::unmap(const char *data, size_t size)
+{
+  munmap((void *)data, size);
+}
+
+
+//every file in root named like get_filename() makes.  Anything else
+//there, such as the value log's segments, is left out.
+void one_file_per_object_backing_store::list_versions(std::vector<std::pair<uint64_t, uint64_t> > &stored)
+{
+  DIR *dir = opendir(root.c_str());
+  if (dir == NULL)
+    return;
+  while (struct dirent *entry = readdir(dir)) {
+    const char *name = entry->d_name;
+    char *end;
+    if (!isdigit(name[0]))
+      continue;
+    uint64_t obj_id = strtoull(name, &end, 10);
+    if (*end != '_' || !isdigit(end[1]))
+      continue;
+    uint64_t version = strtoull(end + 1, &end, 10);
+    if (*end != '\0')
+      continue;
+    stored.push_back(std::make_pair(obj_id, version));
+  }
+  closedir(dir);
+}
 
 //Given an object and version, return the filename corresponding to it.
 std::string one_file_per_object_backing_store::get_filename(uint64_t obj_id, uint64_t version){
@@ -70,3 +535,121 @@ std::string one_file_per_object_backing_store::get_filename(uint64_t obj_id, uin
   return root + "/" + std::to_string(obj_id) + "_" + std::to_string(version);
 
 }
+
+////////////////////////////////////////////////
+// Implementation of the memory_backing_store //
+////////////////////////////////////////////////
+
+// The stream get() hands out, which put() stores back.  Like a file
+// opened for reading and writing, writes overwrite from the start.
+class memory_version_stream : public std::stringstream {
+public:
+  memory_version_stream(uint64_t obj_id, uint64_t version, const std::string &contents)
+    : std::stringstream(contents),
+      obj_id(obj_id),
+      version(version)
+  {}
+  const uint64_t obj_id;
+  const uint64_t version;
+};
+
+memory_backing_store::memory_backing_store(uint64_t latency_ns, uint64_t bytes_per_second)
+  : latency_ns(latency_ns),
+    bytes_per_second(bytes_per_second),
+    bytes_stored(0),
+    device_busy_until(0)
+{}
+
+void memory_backing_store::allocate(uint64_t obj_id, uint64_t version)
+{
+  std::unique_lock<std::mutex> guard(lock);
+  versions[version_key{obj_id, version}];
+}
+
+void memory_backing_store::deallocate(uint64_t obj_id, uint64_t version)
+{
+  io_counters.add(IO_DEALLOCATIONS);
+  std::unique_lock<std::mutex> guard(lock);
+  auto it = versions.find(version_key{obj_id, version});
+  if (it == versions.end())
+    return;
+  bytes_stored -= it->second.size();
+  versions.erase(it);
+}
+
+void memory_backing_store::list_versions(std::vector<std::pair<uint64_t, uint64_t> > &stored)
+{
+  std::unique_lock<std::mutex> guard(lock);
+  for (const auto &entry : versions)
+    stored.push_back(std::make_pair(entry.first.obj_id, entry.first.version));
+}
+
+std::iostream * memory_backing_store::get(uint64_t obj_id, uint64_t version)
+{
+  std::unique_lock<std::mutex> guard(lock);
+  auto it = versions.find(version_key{obj_id, version});
+  assert(it != versions.end());
+  return new memory_version_stream(obj_id, version, it->second);
+}
+
+void memory_backing_store::put(std::iostream *ios)
+{
+  memory_version_stream *stream = dynamic_cast<memory_version_stream *>(ios);
+  assert(stream != NULL);
+  std::string contents = stream->str();
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    std::string &stored = versions[version_key{stream->obj_id, stream->version}];
+    bytes_stored += contents.size() - stored.size();
+    stored.swap(contents);
+  }
+  delete stream;
+}
+
+uint64_t memory_backing_store::get_bytes_stored(void)
+{
+  std::unique_lock<std::mutex> guard(lock);
+  return bytes_stored;
+}
+
+void memory_backing_store::put_image(uint64_t obj_id, uint64_t version, const std::string &bytes)
+{
+  emulate_device(bytes.size());
+  std::unique_lock<std::mutex> guard(lock);
+  std::string &stored = versions[version_key{obj_id, version}];
+  bytes_stored += bytes.size() - stored.size();
+  stored = bytes;
+}
+
+void memory_backing_store::get_image(uint64_t obj_id, uint64_t version, std::string &bytes)
+{
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    auto it = versions.find(version_key{obj_id, version});
+    assert(it != versions.end());
+    bytes = it->second;
+  }
+  emulate_device(bytes.size());
+}
+
+//hold the caller for as long as the emulated device would take to
+//move bytes.  Deadlines are absolute, so oversleeping one request
+//does not push back the ones queued behind it.
+void memory_backing_store::emulate_device(size_t bytes)
+{
+  if (latency_ns == 0 && bytes_per_second == 0)
+    return;
+  uint64_t done = monotonic_ns();
+  if (bytes_per_second) {
+    std::unique_lock<std::mutex> guard(lock);
+    device_busy_until = std::max(device_busy_until, done) +
+      bytes * 1000000000ULL / bytes_per_second;
+    done = device_busy_until;
+  }
+  done += latency_ns;
+  struct timespec deadline;
+  deadline.tv_sec = done / 1000000000ULL;
+  deadline.tv_nsec = done % 1000000000ULL;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+    ;
+}
@@ -7,6 +7,26 @@
 #include <cstdint>
 #include <cstddef>
 #include <iostream>
+#include <string>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include "stat_counters.hpp"
+
+// A group of whole-image requests kept in flight together.  Requests
+// start when they are queued; complete() waits for all of them, after
+// which read buffers are filled in.  Buffers passed in must stay
+// untouched until then.
+class io_batch {
+public:
+  virtual ~io_batch(void) {}
+  virtual void    write(uint64_t obj_id, uint64_t version, const std::string &buffer) = 0;
+  virtual void     read(uint64_t obj_id, uint64_t version, std::string &buffer) = 0;
+  virtual void complete(void) = 0;
+};
 
 class backing_store {
 public:
@@ -14,19 +34,196 @@ public:
   virtual void deallocate(uint64_t obj_id, uint64_t version) = 0;
   virtual std::iostream * get(uint64_t obj_id, uint64_t version) = 0;
   virtual void            put(std::iostream *ios) = 0;
+  // Every (obj_id, version) currently stored, in no particular order.
+  virtual void list_versions(std::vector<std::pair<uint64_t, uint64_t> > &stored) = 0;
+  // Whole images, compressed on the way to disk if
+  // set_compression() is on (see encode_node_image()).  Compressed
+  // images are always decompressed on the way back.
+  void                  write(uint64_t obj_id, uint64_t version, const std::string &buffer);
+  void                   read(uint64_t obj_id, uint64_t version, std::string &buffer);
+  // The default batch runs each request synchronously.
+  virtual io_batch * begin_batch(void);
+  // Read-only view of a stored version, for stores that can map it
+  // into memory.  Returns NULL otherwise.  Release it with unmap().
+  // The view holds the image as stored; see decode_image().
+  virtual const char *    map(uint64_t obj_id, uint64_t version, size_t &size) { return NULL; }
+  virtual void          unmap(const char *data, size_t size) {}
+
+  void set_compression(bool compress);
+  // Decompress a stored image into out.  Returns false if it was
+  // stored raw, in which case data is the image.
+  bool decode_image(const char *data, size_t size, std::string &out);
+
+  // Totals over the images this store compressed and decompressed.
+  struct compression_stats {
+    uint64_t images_written;
+    uint64_t raw_bytes;
+    uint64_t stored_bytes;
+    uint64_t images_decoded;
+    uint64_t decode_ns;
+  };
+  compression_stats get_compression_stats(void) const;
+
+  // Totals over the traffic to the store, counted in stored (i.e.
+  // compressed) bytes.  Writes through put() are not counted in
+  // bytes, since the store does not see their length.
+  struct io_stats {
+    uint64_t reads;
+    uint64_t bytes_read;
+    uint64_t writes;
+    uint64_t bytes_written;
+    uint64_t fsyncs;
+    uint64_t maps;
+    uint64_t bytes_mapped;
+    uint64_t deallocations;
+  };
+  io_stats get_io_stats(void) const;
+
+  virtual ~backing_store(void) {}
+
+protected:
+  // Move an image's bytes as they are stored.  The defaults go
+  // through get() and put(); stores that bypass iostreams override
+  // them.
+  virtual void put_image(uint64_t obj_id, uint64_t version, const std::string &bytes);
+  virtual void get_image(uint64_t obj_id, uint64_t version, std::string &bytes);
+
+  // The bytes to store for an image: buffer itself, or its encoding
+  // in scratch.
+  const std::string & encode_image(const std::string &buffer, std::string &scratch);
+  // Undo encode_image() in place.
+  void decode_image(std::string &bytes);
+
+  enum {
+    IO_READS,
+    IO_BYTES_READ,
+    IO_WRITES,
+    IO_BYTES_WRITTEN,
+    IO_FSYNCS,
+    IO_MAPS,
+    IO_BYTES_MAPPED,
+    IO_DEALLOCATIONS,
+    NUM_IO_COUNTERS
+  };
+  stat_counters<NUM_IO_COUNTERS> io_counters;
+
+private:
+  bool compress = false;
+  std::atomic<uint64_t> images_written{0};
+  std::atomic<uint64_t> raw_bytes{0};
+  std::atomic<uint64_t> stored_bytes{0};
+  std::atomic<uint64_t> images_decoded{0};
+  std::atomic<uint64_t> decode_ns{0};
 };
 
+// Block-aligned buffers for direct I/O, kept for reuse.  Buffers are
+// sized in whole blocks and handed back to the free list of their
+// size.  Thread-safe, since checkpoints write from a background
+// thread.
+class aligned_buffer_pool {
+public:
+  aligned_buffer_pool(size_t block_size, size_t max_free_per_size);
+  ~aligned_buffer_pool(void);
+  char * get(size_t size, size_t &capacity);
+  void   put(char *buffer, size_t capacity);
+  size_t round_up(size_t size) const;
+
+private:
+  const size_t block_size;
+  const size_t max_free_per_size;
+  std::map<size_t, std::vector<char *> > free_buffers;
+  std::mutex lock;
+};
+
+class file_io_batch;
+class async_io;
+
 class one_file_per_object_backing_store: public backing_store {
 public:
-  one_file_per_object_backing_store(std::string rt);
+  // With direct_io, node files are read and written with O_DIRECT, so
+  // the page cache does not hold a second copy of what swap_space
+  // caches, and map() is not supported.  Falls back to buffered I/O
+  // on file systems without O_DIRECT.  Batches run on io_uring
+  // unless use_io_uring is off or the kernel lacks it, in which case
+  // a thread pool does the I/O (see async_io).
+  one_file_per_object_backing_store(std::string rt, bool direct_io = false, bool use_io_uring = true);
+  ~one_file_per_object_backing_store(void);
   void	  allocate(uint64_t obj_id, uint64_t version);
   void		  deallocate(uint64_t obj_id, uint64_t version);
   std::iostream * get(uint64_t obj_id, uint64_t version);
   void            put(std::iostream *ios);
+  void list_versions(std::vector<std::pair<uint64_t, uint64_t> > &stored);
+  io_batch * begin_batch(void);
+  const char *    map(uint64_t obj_id, uint64_t version, size_t &size);
+  void          unmap(const char *data, size_t size);
   std::string get_filename(uint64_t obj_id, uint64_t version);
   
+protected:
+  void      put_image(uint64_t obj_id, uint64_t version, const std::string &bytes);
+  void      get_image(uint64_t obj_id, uint64_t version, std::string &bytes);
+
 private:
+  friend class file_io_batch;
+  static bool supports_direct_io(const std::string &root);
+  int open_direct(const std::string &filename, int flags);
+
   std::string	root;
+  // Settled in the constructor, since the checkpoint thread reads it
+  // alongside the foreground.
+  const bool direct_io;
+  aligned_buffer_pool buffers;
+  // Set up once and shared by every batch.  A batch holds io_lock
+  // while it has requests in flight, since checkpoints write from a
+  // background thread.
+  std::unique_ptr<async_io> io;
+  std::mutex io_lock;
+};
+
+// Keeps every version in memory, for measuring the CPU cost of the
+// tree without a file system underneath.  Reads and writes of whole
+// images can be made to take as long as on a device with the given
+// per-request latency and bandwidth: latency is paid by each request
+// independently, while transfers share the bandwidth and queue behind
+// each other.  Zero turns either off.  Nothing survives the process,
+// so the tree must not be recovered from a version map written by an
+// earlier run.
+class memory_backing_store: public backing_store {
+public:
+  memory_backing_store(uint64_t latency_ns = 0, uint64_t bytes_per_second = 0);
+  void	  allocate(uint64_t obj_id, uint64_t version);
+  void		  deallocate(uint64_t obj_id, uint64_t version);
+  std::iostream * get(uint64_t obj_id, uint64_t version);
+  void            put(std::iostream *ios);
+  void list_versions(std::vector<std::pair<uint64_t, uint64_t> > &stored);
+  // Bytes held in all stored versions
+  uint64_t get_bytes_stored(void);
+
+protected:
+  void      put_image(uint64_t obj_id, uint64_t version, const std::string &bytes);
+  void      get_image(uint64_t obj_id, uint64_t version, std::string &bytes);
+
+private:
+  struct version_key {
+    uint64_t obj_id;
+    uint64_t version;
+    bool operator==(const version_key &other) const {
+      return obj_id == other.obj_id && version == other.version;
+    }
+  };
+  struct version_key_hash {
+    size_t operator()(const version_key &k) const {
+      return std::hash<uint64_t>()(k.obj_id * 0x9e3779b97f4a7c15ULL ^ k.version);
+    }
+  };
+  void emulate_device(size_t bytes);
+
+  const uint64_t latency_ns;
+  const uint64_t bytes_per_second;
+  std::unordered_map<version_key, std::string, version_key_hash> versions;
+  uint64_t bytes_stored;
+  // When the emulated device finishes the transfers queued so far
+  uint64_t device_busy_until;
+  std::mutex lock;
 };
 
 #endif // BACKING_STORE_HPP
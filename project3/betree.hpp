@@ -51,14 +51,18 @@
 // to an on-disk node requires reading it in and writing it out.
 
 #include <map>
+#include <algorithm>
 #include <vector>
 #include <string>
 #include <iostream>
 #include <sstream>
 #include <cassert>
+#include <cstring>
 #include "swap_space.hpp"
 #include "backing_store.hpp"
 #include "logger.hpp"
+#include "value_log.hpp"
+#include "latency_histogram.hpp"
 
 ////////////////// Upserts
 
@@ -173,6 +177,10 @@ bool operator==(const Message<Value> &a, const Message<Value> &b) {
 // Measured in messages.
 #define DEFAULT_MAX_NODE_SIZE (1ULL<<18)
 
+// Messages between restart points in a flat leaf image (see
+// betree::node::_serialize()).
+#define LEAF_RESTART_INTERVAL (16)
+
 // The minimum number of messages that we will flush to an out-of-cache node.
 // Note: we will flush even a single element to a child that is already dirty.
 // Note: we will flush MIN_FLUSH_SIZE/2 items to a clean in-memory child.
@@ -181,6 +189,8 @@ bool operator==(const Message<Value> &a, const Message<Value> &b) {
 
 template<class Key, class Value> class betree {
 private:
+  // Times the node operations in isolation (see microbench.cpp).
+  friend class node_benchmark;
   class node;
   // We let a swap_space handle all the I/O.
   typedef typename swap_space::pointer<node> node_pointer;
@@ -278,17 +288,29 @@ private:
       return it == pivots.end() ? elements.end() : get_element_begin(it->first);
     }
 
+    // An insert or delete replaces the older messages for its key,
+    // which may hold the last reference to a value in the value log.
+    void release_values(const betree &bet, const MessageKey<Key> &mkey) {
+      if (!bet.vlog)
+	return;
+      auto end = elements.upper_bound(mkey.range_end());
+      for (auto it = elements.lower_bound(mkey.range_start()); it != end; ++it)
+	if (it->second.opcode == INSERT)
+	  value_log_release(*bet.vlog, it->second.val);
+    }
+
     // Apply a message to ourself.
-    void apply(const MessageKey<Key> &mkey, const Message<Value> &elt,
-	       Value &default_value) {
+    void apply(const betree &bet, const MessageKey<Key> &mkey, const Message<Value> &elt) {
       switch (elt.opcode) {
       case INSERT:
+	release_values(bet, mkey);
 	elements.erase(elements.lower_bound(mkey.range_start()),
 		       elements.upper_bound(mkey.range_end()));
 	elements[mkey] = elt;
 	break;
 
       case DELETE:
+	release_values(bet, mkey);
 	elements.erase(elements.lower_bound(mkey.range_start()),
 		       elements.upper_bound(mkey.range_end()));
 	if (!is_leaf())
@@ -302,17 +324,19 @@ private:
 	    iter--;
 	  if (iter == elements.end() || iter->first.key != mkey.key)
 	    if (is_leaf()) {
-	      Value dummy = default_value;
-	      apply(mkey, Message<Value>(INSERT, dummy + elt.val),
-		    default_value);
+	      Value dummy = bet.stored_value(bet.default_value);
+	      apply(bet, mkey, Message<Value>(INSERT, dummy + elt.val));
 	    } else {
 	      elements[mkey] = elt;
 	    }
 	  else {
 	    assert(iter != elements.end() && iter->first.key == mkey.key);
-	    if (iter->second.opcode == INSERT) {
-	      apply(mkey, Message<Value>(INSERT, iter->second.val + elt.val),
-		    default_value);	  
+	    // An insert that refers to the value log may be shadowed by a
+	    // newer one further up, and its segment collected, so it is
+	    // never read here.  The update stays next to it instead.
+	    if (iter->second.opcode == INSERT &&
+		!(bet.vlog && value_log_is_reference(iter->second.val))) {
+	      apply(bet, mkey, Message<Value>(INSERT, iter->second.val + elt.val));
 	    } else {
 	      elements[mkey] = elt;	      
 	    }
@@ -362,11 +386,14 @@ private:
 	      things_moved++;
 	    }
 	  } else {
-	    // Must be a leaf
+	    // Must be a leaf.  Updates kept after an insert stay with it.
 	    assert(pivots.size() == 0);
-	    new_node->elements[elt_idx->first] = elt_idx->second;
-	    ++elt_idx;
-	    things_moved++;	    
+	    Key key = elt_idx->first.key;
+	    while (elt_idx != elements.end() && elt_idx->first.key == key) {
+	      new_node->elements[elt_idx->first] = elt_idx->second;
+	      ++elt_idx;
+	      things_moved++;
+	    }
 	  }
 	}
       }
@@ -438,7 +465,7 @@ private:
 
       if (is_leaf()) {
 	for (auto it = elts.begin(); it != elts.end(); ++it)
-	  apply(it->first, it->second, bet.default_value);
+	  apply(bet, it->first, it->second);
 	if (elements.size() + pivots.size() >= bet.max_node_size)
 	  result = split(bet);
 	return result;
@@ -479,9 +506,36 @@ private:
 	}
 
       } else {
-	
-	for (auto it = elts.begin(); it != elts.end(); ++it)
-	  apply(it->first, it->second, bet.default_value);
+
+	// A batch can span several children.  The messages for a dirty
+	// child with nothing buffered here go straight to it, as in the
+	// single-child case above, so we never buffer messages for a
+	// dirty child.  Everything else is buffered here.
+	auto elt_it = elts.begin();
+	while (elt_it != elts.end()) {
+	  auto pivot_idx = get_pivot(elt_it->first.key);
+	  auto next_pivot_idx = next(pivot_idx);
+	  auto elt_end = next_pivot_idx == pivots.end() ?
+	    elts.end() :
+	    elts.lower_bound(MessageKey<Key>::range_start(next_pivot_idx->first));
+	  if (pivot_idx->second.child.is_dirty() &&
+	      get_element_begin(pivot_idx) == get_element_begin(next_pivot_idx)) {
+	    message_map child_elts(elt_it, elt_end);
+	    pivot_map new_children = pivot_idx->second.child->flush(bet, child_elts);
+	    if (!new_children.empty()) {
+	      pivots.erase(pivot_idx);
+	      pivots.insert(new_children.begin(), new_children.end());
+	    } else {
+	      pivot_idx->second.child_size =
+		pivot_idx->second.child->pivots.size() +
+		pivot_idx->second.child->elements.size();
+	    }
+	  } else {
+	    for (auto it = elt_it; it != elt_end; ++it)
+	      apply(bet, it->first, it->second);
+	  }
+	  elt_it = elt_end;
+	}
 
 	// Now flush to out-of-core or clean children as necessary
 	while (elements.size() + pivots.size() >= bet.max_node_size) {
@@ -513,7 +567,7 @@ private:
 	    pivots.erase(child_pivot);
 	    pivots.insert(new_children.begin(), new_children.end());
 	  } else {
-	    first_pivot_idx->second.child_size =
+	    child_pivot->second.child_size =
 	      child_pivot->second.child->pivots.size() +
 	      child_pivot->second.child->elements.size();
 	  }
@@ -534,10 +588,19 @@ private:
     Value query(const betree & bet, const Key k) const
     {
       if (is_leaf()) {
+        // Nothing above has an insert or delete for k, so the insert
+        // here is live and its updates can be applied.
         auto it = elements.lower_bound(MessageKey<Key>::range_start(k));
         if (it != elements.end() && it->first.key == k) {
           assert(it->second.opcode == INSERT);
-          return it->second.val;
+          Value v = it->second.val;
+          if (++it != elements.end() && it->first.key == k)
+            v = bet.load_value(v);
+          for (; it != elements.end() && it->first.key == k; ++it) {
+            assert(it->second.opcode == UPDATE);
+            v = v + it->second.val;
+          }
+          return v;
         } else {
           throw std::out_of_range("Key does not exist");
         }
@@ -546,12 +609,12 @@ private:
       ///////////// Non-leaf
       
       auto message_iter = get_element_begin(k);
-      Value v = bet.default_value;
+      Value v = bet.stored_value(bet.default_value);
 
       if (message_iter == elements.end() || k < message_iter->first){
         // If we don't have any messages for this key, just search
         // further down the tree.
-        v = get_pivot(k)->second.child->query(bet, k);
+        v = query_child(bet, get_pivot(k)->second.child, k);
       }
       else if (message_iter->second.opcode == UPDATE) {
         // We have some updates for this key.  Search down the tree.
@@ -559,7 +622,7 @@ private:
         // doesn't have anything, then apply our updates to the
         // default initial value.
         try {
-          Value t = get_pivot(k)->second.child->query(bet, k);
+          Value t = query_child(bet, get_pivot(k)->second.child, k);
           v = t;
         } catch (std::out_of_range & e) {}
       } else if (message_iter->second.opcode == DELETE) {
@@ -578,6 +641,8 @@ private:
       }
 
       // Apply any updates to the value obtained above.
+      if (message_iter != elements.end() && message_iter->first.key == k)
+        v = bet.load_value(v);
       while (message_iter != elements.end() && message_iter->first.key == k) {
         assert(message_iter->second.opcode == UPDATE);
         v = v + message_iter->second.val;
@@ -627,7 +692,141 @@ private:
       }
     }
     
+    // Leaves are written in a flat binary format that query_image()
+    // can search without deserializing the node:
+    //   flatleaf <count> <bytes>\n
+    //   uint64 nrestarts, uint64 restarts[nrestarts], then the messages.
+    // A message is varints for the length of the key prefix it shares
+    // with the previous message's key, the length of the rest of the
+    // key, and the timestamp; then the rest of the key (see
+    // flat_codec::encode_key), a byte of opcode and the value.  Every
+    // LEAF_RESTART_INTERVAL-th message is a restart point that shares
+    // nothing, and restarts[] holds their offsets into the messages,
+    // so a lookup binary-searches the restart points and then decodes
+    // at most one interval.
+    static bool leaves_are_flat(void) {
+      return flat_codec<Key>::supported && flat_codec<Value>::supported;
+    }
+
+    // Decode the message at p into key (which holds the previous
+    // key), timestamp, opcode and the address of its value.  Returns
+    // the next message.
+    static const char *next_flat_message(const char *p, std::string &key, uint64_t &timestamp,
+                                         int &opcode, const char *&value) {
+      uint64_t shared = get_varint(p);
+      uint64_t unshared = get_varint(p);
+      timestamp = get_varint(p);
+      key.resize(shared);
+      key.append(p, unshared);
+      p += unshared;
+      opcode = (unsigned char)*p++;
+      value = p;
+      return p + flat_codec<Value>::size(p);
+    }
+
+    static int compare_key_bytes(const char *a, size_t alen, const std::string &b) {
+      int c = memcmp(a, b.data(), std::min(alen, b.size()));
+      if (c != 0)
+        return c;
+      return alen < b.size() ? -1 : alen > b.size();
+    }
+
+    // Point lookup in a serialized leaf, read in place.  Returns false
+    // if the image is not in the flat format.
+    static bool query_image(const char *data, size_t size, const Key &k, Value &v) {
+      const char *eol = (const char *)memchr(data, '\n', size);
+      if (size < 9 || memcmp(data, "flatleaf ", 9) != 0 || eol == NULL)
+        return false;
+      uint64_t count = strtoull(data + 9, NULL, 10);
+      uint64_t nrestarts;
+      memcpy(&nrestarts, eol + 1, sizeof(nrestarts));
+      const char *restarts = eol + 1 + sizeof(uint64_t);
+      const char *messages = restarts + nrestarts * sizeof(uint64_t);
+      std::string target;
+      flat_codec<Key>::encode_key(target, k);
+
+      // Find the first restart point whose key is not below k.  The
+      // first message for k is in the interval before it.
+      uint64_t lo = 0, hi = nrestarts;
+      while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        uint64_t offset;
+        memcpy(&offset, restarts + mid * sizeof(uint64_t), sizeof(offset));
+        const char *p = messages + offset;
+        get_varint(p);
+        uint64_t length = get_varint(p);
+        get_varint(p);
+        if (compare_key_bytes(p, length, target) < 0)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+      uint64_t first = lo > 0 ? lo - 1 : 0;
+      uint64_t offset = 0;
+      if (nrestarts > 0)
+        memcpy(&offset, restarts + first * sizeof(uint64_t), sizeof(offset));
+
+      const char *p = messages + offset;
+      std::string key;
+      uint64_t timestamp;
+      int opcode;
+      const char *value;
+      for (uint64_t i = first * LEAF_RESTART_INTERVAL; i < count; i++) {
+        p = next_flat_message(p, key, timestamp, opcode, value);
+        int c = compare_key_bytes(key.data(), key.size(), target);
+        if (c < 0)
+          continue;
+        if (c == 0) {
+          assert(opcode == INSERT);
+          v = flat_codec<Value>::decode(value);
+          // Updates kept after the insert need the value log, so
+          // leave those to query().
+          if (i + 1 < count) {
+            std::string next = key;
+            next_flat_message(p, next, timestamp, opcode, value);
+            if (next == key)
+              return false;
+          }
+          return true;
+        }
+        break;
+      }
+      throw std::out_of_range("Key does not exist");
+    }
+
     void _serialize(std::iostream &fs, serialization_context &context) {
+      if (is_leaf() && leaves_are_flat()) {
+        std::string restarts, messages, key, previous;
+        uint64_t nrestarts = 0;
+        uint64_t i = 0;
+        for (auto it = elements.begin(); it != elements.end(); ++it, ++i) {
+          key.clear();
+          flat_codec<Key>::encode_key(key, it->first.key);
+          size_t shared = 0;
+          if (i % LEAF_RESTART_INTERVAL == 0) {
+            uint64_t offset = messages.size();
+            restarts.append((const char *)&offset, sizeof(offset));
+            nrestarts++;
+          } else {
+            size_t limit = std::min(key.size(), previous.size());
+            while (shared < limit && key[shared] == previous[shared])
+              shared++;
+          }
+          put_varint(messages, shared);
+          put_varint(messages, key.size() - shared);
+          put_varint(messages, it->first.timestamp);
+          messages.append(key, shared, std::string::npos);
+          messages.push_back((char)it->second.opcode);
+          flat_codec<Value>::encode(messages, it->second.val);
+          previous.swap(key);
+        }
+        fs << "flatleaf " << elements.size() << " "
+           << sizeof(nrestarts) + restarts.size() + messages.size() << std::endl;
+        fs.write((const char *)&nrestarts, sizeof(nrestarts));
+        fs.write(restarts.data(), restarts.size());
+        fs.write(messages.data(), messages.size());
+        return;
+      }
       fs << "pivots:" << std::endl;
       serialize(fs, context, pivots);
       fs << "elements:" << std::endl;
@@ -637,11 +836,44 @@ private:
     void _deserialize(std::iostream &fs, serialization_context &context) {
       std::string dummy;
       fs >> dummy;
+      if (dummy == "flatleaf") {
+        uint64_t count, size;
+        fs >> count >> size;
+        fs.get();
+        std::string image(size, '\0');
+        fs.read(&image[0], size);
+        uint64_t nrestarts;
+        memcpy(&nrestarts, image.data(), sizeof(nrestarts));
+        const char *p = image.data() + sizeof(uint64_t) * (nrestarts + 1);
+        std::string key;
+        for (uint64_t i = 0; i < count; i++) {
+          uint64_t timestamp;
+          int opcode;
+          const char *value;
+          p = next_flat_message(p, key, timestamp, opcode, value);
+          elements.emplace_hint(elements.end(),
+                                MessageKey<Key>(flat_codec<Key>::decode_key(key.data(), key.size()),
+                                                timestamp),
+                                Message<Value>(opcode, flat_codec<Value>::decode(value)));
+        }
+        return;
+      }
       deserialize(fs, context, pivots);
       fs >> dummy;
       deserialize(fs, context, elements);
     }
 
+    // Cold leaves are searched in place when the swap_space allows
+    // it, rather than loaded into the cache.
+    static Value query_child(const betree &bet, const node_pointer &child, const Key &k) {
+      Value v;
+      if (bet.ss->read_mapped(child.get_target(), [&](const char *data, size_t size) {
+            return query_image(data, size, k, v);
+          }))
+        return v;
+      return child->query(bet, k);
+    }
+
     
   };
 
@@ -654,54 +886,245 @@ private:
   Value default_value;
   Logger& logger;
   uint64_t operation_count = 0;
+  bool fuzzy_checkpoints = false;
+  // Inserted values of at least value_log_threshold bytes are written
+  // once to vlog and the tree only keeps references to them.  Only
+  // std::string values are ever moved to the log.  Recovery may need
+  // the log, so it is passed to the constructor.
+  value_log *vlog = NULL;
+  uint64_t value_log_threshold = 0;
 
+public:
+  // How long the constructor spent on each phase of recovery.
+  struct recovery_stats {
+    uint64_t version_map_ns;   // rebuildVersionMap()
+    uint64_t object_map_ns;    // rebuildObjectMap()
+    uint64_t root_ns;          // Loading or allocating the root
+    uint64_t log_read_ns;      // Reading and parsing the log
+    uint64_t replay_ns;        // Applying the records past the checkpoint
+    uint64_t records_read;
+    uint64_t records_replayed;
+  };
+
+  // Checkpoints taken so far.  A stall is the time a checkpoint held
+  // up the upsert that triggered it; the duration runs until it is on
+  // disk, which for a fuzzy checkpoint is when the background thread
+  // finishes.
+  struct checkpoint_stats {
+    uint64_t checkpoints;
+    latency_histogram stall_ns;
+    latency_histogram duration_ns;
+  };
+
+private:
+  recovery_stats recovery = recovery_stats();
+  checkpoint_stats checkpoints = checkpoint_stats();
+  std::mutex checkpoint_stats_lock;  // Fuzzy checkpoints finish on another thread
+
+  void record_checkpoint_stall(uint64_t ns) {
+    std::lock_guard<std::mutex> guard(checkpoint_stats_lock);
+    checkpoints.checkpoints++;
+    checkpoints.stall_ns.record(ns);
+  }
+
+  void record_checkpoint_duration(uint64_t ns) {
+    std::lock_guard<std::mutex> guard(checkpoint_stats_lock);
+    checkpoints.duration_ns.record(ns);
+  }
   
 public:
 	betree(swap_space *sspace,
            uint64_t maxnodesize,
            uint64_t minnodesize,
            uint64_t minflushsize,
-           Logger& logger):
+           Logger& logger,
+           value_log *vlog = NULL,
+           uint64_t value_log_threshold = 0):
     ss(sspace),
     min_flush_size(minflushsize),
     max_node_size(maxnodesize),
     min_node_size(minnodesize),
     logger(logger),
-    operation_count(0)
+    operation_count(0),
+    vlog(vlog),
+    value_log_threshold(value_log_threshold)
     {
       recoveryManager recoverManager_(sspace, this);
       uint64_t temp_root_id = recoverManager_.recoverState();
     }
+
+    ~betree(void) {
+      ss->wait_for_checkpoint();
+    }
+
+    // In fuzzy mode, checkpoints only snapshot dirty nodes on the
+    // write path and leave the I/O to the swap_space's background
+    // thread.  The log is truncated once the snapshot is on disk.
+    void set_fuzzy_checkpoints(bool fuzzy) {
+      fuzzy_checkpoints = fuzzy;
+    }
+
+    recovery_stats get_recovery_stats() const {
+      return recovery;
+    }
+
+    checkpoint_stats get_checkpoint_stats() {
+      std::lock_guard<std::mutex> guard(checkpoint_stats_lock);
+      return checkpoints;
+    }
+
+    // With a value log, the tree stores values tagged (see
+    // value_log.hpp).  stored_value() is the stored form of a value
+    // and resolve_value() turns it back.
+    Value stored_value(const Value &v) const {
+      return vlog ? value_log_inline(v) : v;
+    }
+
+    Value resolve_value(const Value &v) const {
+      return vlog ? value_log_read(*vlog, v) : v;
+    }
+
+    // A stored value with any reference read back in, so that updates
+    // can be appended to it.
+    Value load_value(const Value &v) const {
+      return vlog && value_log_is_reference(v) ? stored_value(resolve_value(v)) : v;
+    }
     
 
     void checkpoint() {
       // Perform checkpointing only after a certain number of operations (threshold)
+      if (fuzzy_checkpoints) {
+        fuzzy_checkpoint();
+        return;
+      }
+      uint64_t start = monotonic_ns();
 
       // Flush logs
       logger.flush();
+      uint64_t checkpoint_lsn = logger.get_next_lsn();
+
+      // The nodes may refer to anything in the value log
+      std::vector<uint64_t> moved = sync_value_log();
 
       // Flush the lru queue
       ss->write_back_dirty_pages_info_to_disk();
 
       // Flush map to disk
-      ss->write_version_map_to_disk();
+      ss->write_version_map_to_disk(checkpoint_lsn);
 
       // Clear the log on disk
       logger.clear_log_on_disk();
 
       ss->delete_old_version();
+      if (vlog)
+        vlog->remove(moved);
 
       // Push Checkpoint entry
 	    Logger::LogRecord record = {3, 0, "", next_timestamp}; 
       logger.log(record);
 
       operation_count = 0;
+      collect_value_log();
+
+      uint64_t elapsed = monotonic_ns() - start;
+      record_checkpoint_stall(elapsed);
+      record_checkpoint_duration(elapsed);
+    }
+
+    void fuzzy_checkpoint() {
+      // Still writing the last one; try again after the next upsert.
+      if (ss->checkpoint_in_progress())
+        return;
+      uint64_t start = monotonic_ns();
+
+      // Everything logged so far is reflected in the snapshot, so it
+      // must be on disk with an LSN below the checkpoint LSN.
+      logger.flush();
+      uint64_t checkpoint_lsn = logger.get_next_lsn();
+
+      std::vector<uint64_t> moved = sync_value_log();
+      Logger *log = &logger;
+      value_log *values = vlog;
+      ss->begin_checkpoint(checkpoint_lsn, [this, log, checkpoint_lsn, values, moved, start]() {
+        log->truncate_log_before(checkpoint_lsn);
+        if (values)
+          values->remove(moved);
+        record_checkpoint_duration(monotonic_ns() - start);
+      });
+
+      // Push Checkpoint entry
+      Logger::LogRecord record = {3, 0, "", next_timestamp};
+      logger.log(record);
+
+      operation_count = 0;
+      collect_value_log();
+      record_checkpoint_stall(monotonic_ns() - start);
+    }
+
+    // Make the value log durable before a checkpoint writes nodes
+    // that refer to it.  Returns the segments collected since the last
+    // checkpoint, which can go once this one is on disk.
+    std::vector<uint64_t> sync_value_log() {
+      if (!vlog)
+        return std::vector<uint64_t>();
+      vlog->sync();
+      return vlog->take_retired();
+    }
+
+    // Copy the live values out of a value log segment that is mostly
+    // garbage.  The copies are in the tree by the next checkpoint,
+    // which then removes the segment.  A record is live if querying
+    // its key gives back its reference.  If the query gives a value
+    // that is not a reference, the record may still be buried under
+    // updates, so that value is inserted afresh to cover it.
+    void collect_value_log() {
+      uint64_t segment;
+      if (!vlog || !vlog->pick_victim(segment))
+        return;
+      vlog->scan(segment, [this](const std::string &key, const std::string &reference) {
+        Key k = flat_codec<Key>::decode_key(key.data(), key.size());
+        Value v;
+        try {
+          v = root->query(*this, k);
+        } catch (std::out_of_range &e) {
+          return;
+        }
+        if (value_log_is_reference(v) && !value_log_refers(v, reference))
+          return;
+        message_map tmp;
+        tmp[MessageKey<Key>(k, ++next_timestamp)] =
+          Message<Value>(INSERT, separate_value(k, resolve_value(v)));
+        flush_into_root(tmp);
+      });
+      vlog->retire(segment);
+    }
+
+    // Large inserted values go to the value log, and the tree gets a
+    // reference instead.
+    Value separate_value(const Key &k, const Value &v) {
+      if (!vlog)
+        return v;
+      if (!flat_codec<Key>::supported || value_log_size(v) < value_log_threshold)
+        return stored_value(v);
+      std::string key;
+      flat_codec<Key>::encode_key(key, k);
+      return value_log_append(*vlog, key, v);
     }
 
     void clear_log() {
         logger.clear_log();
     }
 
+    // Flush a batch of messages into the root and handle a split of
+    // the root if it occurs.
+    void flush_into_root(message_map &msgs) {
+        pivot_map new_nodes = root->flush(*this, msgs);
+        if (new_nodes.size() > 0) {
+            root = ss->allocate_root(new node);
+            root->pivots = new_nodes;
+        }
+    }
+
     // Insert the specified message and handle a split of the root if it occurs.
     void upsert(int opcode, Key k, Value v, bool do_log) {
         operation_count++;
@@ -712,12 +1135,9 @@ public:
         }
 
         message_map tmp;
-        tmp[MessageKey<Key>(k, next_timestamp)] = Message<Value>(opcode, v);
-        pivot_map new_nodes = root->flush(*this, tmp);
-        if (new_nodes.size() > 0) {
-            root = ss->allocate_root(new node);
-            root->pivots = new_nodes;
-        }
+        tmp[MessageKey<Key>(k, next_timestamp)] =
+          Message<Value>(opcode, opcode == INSERT ? separate_value(k, v) : v);
+        flush_into_root(tmp);
 
         if (operation_count >= logger.get_checkpoint_granularity()) {
             checkpoint();
@@ -742,7 +1162,7 @@ public:
   Value query(Key k)
   {
     Value v = root->query(*this, k);
-    return v;
+    return resolve_value(v);
   }
 
   void dump_messages(void) {
@@ -790,18 +1210,23 @@ public:
       } catch (std::out_of_range & e) {}
     }
 
+    // Updates are collected rather than applied to second, since an
+    // older insert may refer to a value log segment that is gone.
     void apply(const MessageKey<Key> &msgkey, const Message<Value> &msg) {
       switch (msg.opcode) {
       case INSERT:
   	first = msgkey.key;
   	second = msg.val;
+	updates.clear();
   	is_valid = true;
   	break;
       case UPDATE:
   	first = msgkey.key;
-  	if (is_valid == false)
-  	  second = bet.default_value;
-  	second = second + msg.val;
+  	if (is_valid == false) {
+  	  second = bet.stored_value(bet.default_value);
+	  updates.clear();
+	}
+	updates.push_back(msg.val);
   	is_valid = true;
   	break;
       case DELETE:
@@ -823,6 +1248,14 @@ public:
 	  pos_is_valid = false;
 	}
       }
+      // Only the final value is resolved: older inserts of this key may
+      // refer to value log segments that are gone.
+      if (is_valid) {
+	second = bet.resolve_value(second);
+	for (const Value &update : updates)
+	  second = second + update;
+      }
+      updates.clear();
     }
 
     bool operator==(const iterator &other) {
@@ -848,6 +1281,7 @@ public:
     bool pos_is_valid;
     Key first;
     Value second;
+    std::vector<Value> updates;  // Since the insert in second
   };
 
   iterator begin(void) const {
@@ -897,33 +1331,43 @@ public:
         uint64_t recoverState() {
           uint64_t rootId = UINT64_MAX;
           uint64_t next = UINT64_MAX;
+          uint64_t checkpointLsn = 0;
           std::string versionMapFilename;
           std::string logFilename;
 
+          recovery_stats &stats = betree_->recovery;
+
           // Get version and log file names
           readMasterLog(versionMapFilename, logFilename);
 
-          // Read in version_map.txt
+          // Read in the version map
           // If empty do nothing
           // Else make dictionary and find root
-          if(sspace->rebuildVersionMap(versionMapFilename, rootId, next)) {
+          uint64_t start = monotonic_ns();
+          if(sspace->rebuildVersionMap(versionMapFilename, rootId, next, checkpointLsn)) {
               std::cout << "ERROR: rebuilding map" << std::endl;
               assert(false);
           }
+          stats.version_map_ns = monotonic_ns() - start;
 
           // Rebuild Object Map
+          start = monotonic_ns();
           sspace->rebuildObjectMap(next);
+          stats.object_map_ns = monotonic_ns() - start;
 
           // Set root node
+          start = monotonic_ns();
           if(rootId != UINT64_MAX) {
             betree_->root = sspace->get_root(new node, rootId);
           }
           else {
             betree_->root = sspace->allocate_root(new node);
           }
+          stats.root_ns = monotonic_ns() - start;
 
           // Read log only apply log entries after checkpoint
-          replayLogs();
+          betree_->logger.advance_lsn(checkpointLsn);
+          replayLogs(logFilename, checkpointLsn);
 
           return rootId;
         }
@@ -957,70 +1401,72 @@ public:
           return 0;
         }
 
-        void replayLogs(void) {
-          // Read in Log file
-          // Check if checkpoint is in file
-          // apply logs after checkpoint
-          // betree_->upsert(1, Key k, Value v)
-		  
-          std::ifstream logFile("kv_store.log");
-          if (!logFile.is_open()) {
-            std::cerr << "Error: Unable to open log file: " << std::endl;
-            return;
-          }
-
-          int logReplayCount = 0;
-          int lsn;
-          int operation = 4;
-          std::string value;  
-          uint64_t key;
-          unsigned long timestamp;
-          std::string line;
-          while (std::getline(logFile, line)) {
-            logReplayCount++;
-            value = "";
-
-            size_t pos = line.find("\"operation\":");
-            if (pos != std::string::npos) {
-              operation = std::stoi(line.substr(pos + 12, line.find(",", pos) - pos - 12));
-            }
-
-            pos = line.find("\"key\":");
-            if (pos != std::string::npos) {
-              key = std::stoull(line.substr(pos + 6, line.find(",", pos) - pos - 6));
-            }
-
-            pos = line.find("\"value\":");
-            if (pos != std::string::npos) {
-              size_t start = line.find("\"", pos + 8) + 1;
-              size_t end = line.find("\"", start);
-              value = line.substr(start, end - start);
+        // Reapply everything logged since the last checkpoint, i.e.
+        // records with an LSN of at least checkpointLsn.  The
+        // log is parsed in parallel, then applied in batches of up to
+        // max_node_size messages, each flushed into the root at once.
+        // Messages get the timestamps upsert() gave them originally,
+        // so a batch is ordered exactly like the operations were, and
+        // next_timestamp carries on after the last one.  The log holds
+        // whole values, so large inserted values go to the value log
+        // again, as in upsert().
+        void replayLogs(const std::string &logFilename, uint64_t checkpointLsn) {
+          recovery_stats &stats = betree_->recovery;
+          uint64_t start = monotonic_ns();
+          std::vector<Logger::LogRecord> records = Logger::read_log(logFilename);
+          stats.log_read_ns = monotonic_ns() - start;
+          stats.records_read = records.size();
+          start = monotonic_ns();
+
+          message_map batch;
+          uint64_t replayed = 0;
+          uint64_t expectedLsn = checkpointLsn;
+          for (auto it = records.begin(); it != records.end(); ++it) {
+            // Records without an LSN predate LSNs and are always replayed.
+            if (it->lsn != UINT64_MAX) {
+              if (it->lsn < checkpointLsn) {
+                // Already in the checkpointed tree.
+                betree_->next_timestamp = std::max(betree_->next_timestamp, it->timestamp + 1);
+                continue;
+              }
+              if (it->lsn != expectedLsn) {
+                std::cerr << "Warning: log records " << expectedLsn << " to "
+                          << it->lsn - 1 << " are missing" << std::endl;
+              }
+              expectedLsn = it->lsn + 1;
             }
 
-            pos = line.find("\"timestamp\":");
-            if (pos != std::string::npos) {
-              timestamp = std::stoul(line.substr(pos + 12));
-            }
-            switch (operation) {
-              case 0: 
-                betree_->insert(key, value, false);
-                break;
-              case 1:
-                betree_->update(key, value, false);
-                break;
-              case 2:
-                betree_->erase(key, false);
+            switch (it->opcode) {
+              case INSERT:
+              case DELETE:
+              case UPDATE:
+                batch[MessageKey<Key>(it->key, it->timestamp + 1)] =
+                  Message<Value>(it->opcode, it->opcode == INSERT ?
+                                 betree_->separate_value(it->key, it->value) : it->value);
+                betree_->next_timestamp = std::max(betree_->next_timestamp, it->timestamp + 1);
+                replayed++;
                 break;
               case 3:
+                betree_->next_timestamp = std::max(betree_->next_timestamp, it->timestamp);
                 break;
               default:
-                std::cerr << "Error: Unknown operation type: " << operation << std::endl;
+                std::cerr << "Error: Unknown operation type: " << it->opcode << std::endl;
                 break;
             }
 
+            if (batch.size() >= betree_->max_node_size) {
+              betree_->flush_into_root(batch);
+              batch.clear();
+            }
           }
-          logFile.close();
-        };
+          betree_->flush_into_root(batch);
+
+          // The replayed records are still only in the log, so they
+          // count towards the next checkpoint.
+          betree_->operation_count += replayed;
+          stats.replay_ns = monotonic_ns() - start;
+          stats.records_replayed = replayed;
+        }
 		  
   };
 };
@@ -0,0 +1,202 @@
+#include "compression.hpp"
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#define MIN_MATCH (4)
+#define LAST_LITERALS (5)
+#define MAX_OFFSET (65535)
+#define HASH_BITS (12)
+
+static inline uint32_t read32(const char *p)
+{
+  uint32_t x;
+  memcpy(&x, p, sizeof(x));
+  return x;
+}
+
+static inline uint32_t hash32(uint32_t x)
+{
+  return (x * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static void put_length(std::string &out, size_t len)
+{
+  while (len >= 255) {
+    out.push_back((char)255);
+    len -= 255;
+  }
+  out.push_back((char)len);
+}
+
+static void emit_sequence(std::string &out, const char *literals, size_t nliterals,
+                          size_t offset, size_t match_len)
+{
+  size_t ml = match_len ? match_len - MIN_MATCH : 0;
+  unsigned char token = (unsigned char)(((nliterals < 15 ? nliterals : 15) << 4) |
+                                        (ml < 15 ? ml : 15));
+  out.push_back((char)token);
+  if (nliterals >= 15)
+    put_length(out, nliterals - 15);
+  out.append(literals, nliterals);
+  if (match_len == 0)
+    return;
+  out.push_back((char)(offset & 0xff));
+  out.push_back((char)(offset >> 8));
+  if (ml >= 15)
+    put_length(out, ml - 15);
+}
+
+std::string compress_buffer(const char *src, size_t len)
+{
+  std::string out;
+  out.reserve(len / 2 + 16);
+
+  // Positions are stored +1 so that 0 means "empty".
+  std::vector<uint32_t> table(1 << HASH_BITS, 0);
+  size_t anchor = 0;
+  size_t i = 0;
+
+  if (len > MIN_MATCH + LAST_LITERALS) {
+    size_t limit = len - LAST_LITERALS;
+    while (i + MIN_MATCH <= limit) {
+      uint32_t seq = read32(src + i);
+      uint32_t h = hash32(seq);
+      size_t ref = table[h];
+      table[h] = i + 1;
+      if (ref == 0 || i - (ref - 1) > MAX_OFFSET || read32(src + ref - 1) != seq) {
+        i++;
+        continue;
+      }
+      ref--;
+
+      size_t match_len = MIN_MATCH;
+      while (i + match_len < limit && src[ref + match_len] == src[i + match_len])
+        match_len++;
+
+      emit_sequence(out, src + anchor, i - anchor, i - ref, match_len);
+      i += match_len;
+      anchor = i;
+    }
+  }
+
+  emit_sequence(out, src + anchor, len - anchor, 0, 0);
+  return out;
+}
+
+std::string compress_buffer(const std::string &src)
+{
+  return compress_buffer(src.data(), src.size());
+}
+
+static bool get_length(const unsigned char *&ip, const unsigned char *end, size_t &len)
+{
+  unsigned char b;
+  do {
+    if (ip >= end)
+      return false;
+    b = *ip++;
+    len += b;
+  } while (b == 255);
+  return true;
+}
+
+bool decompress_buffer(const char *src, size_t len, size_t raw_size, std::string &out)
+{
+  const unsigned char *ip = (const unsigned char *)src;
+  const unsigned char *end = ip + len;
+
+  // Decode straight into the final buffer; op is the write position.
+  out.resize(raw_size);
+  char *base = &out[0];
+  size_t op = 0;
+
+  while (ip < end) {
+    unsigned char token = *ip++;
+
+    size_t nliterals = token >> 4;
+    if (nliterals == 15 && !get_length(ip, end, nliterals))
+      return false;
+    if ((size_t)(end - ip) < nliterals || op + nliterals > raw_size)
+      return false;
+    memcpy(base + op, ip, nliterals);
+    op += nliterals;
+    ip += nliterals;
+
+    if (ip == end)
+      break;
+
+    if (end - ip < 2)
+      return false;
+    size_t offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    size_t match_len = token & 15;
+    if (match_len == 15 && !get_length(ip, end, match_len))
+      return false;
+    match_len += MIN_MATCH;
+    if (offset == 0 || offset > op || op + match_len > raw_size)
+      return false;
+
+    // Matches may overlap the bytes they produce; only those need to
+    // be copied one at a time.
+    char *from = base + op - offset;
+    if (offset >= match_len) {
+      memcpy(base + op, from, match_len);
+    } else {
+      for (size_t k = 0; k < match_len; k++)
+        base[op + k] = from[k];
+    }
+    op += match_len;
+  }
+
+  return op == raw_size;
+}
+
+bool decompress_buffer(const std::string &src, size_t raw_size, std::string &out)
+{
+  return decompress_buffer(src.data(), src.size(), raw_size, out);
+}
+
+#define NODE_IMAGE_MAGIC (0x7a696e00U)
+#define NODE_IMAGE_HEADER_SIZE (16)
+
+static std::string node_image_header(uint32_t codec, uint64_t raw_size)
+{
+  char header[NODE_IMAGE_HEADER_SIZE];
+  uint32_t magic = NODE_IMAGE_MAGIC;
+  memcpy(header, &magic, sizeof(magic));
+  memcpy(header + 4, &codec, sizeof(codec));
+  memcpy(header + 8, &raw_size, sizeof(raw_size));
+  return std::string(header, sizeof(header));
+}
+
+std::string encode_node_image(const std::string &raw)
+{
+  std::string compressed = compress_buffer(raw);
+  if (compressed.size() < raw.size())
+    return node_image_header(NODE_CODEC_LZ, raw.size()) + compressed;
+  return node_image_header(NODE_CODEC_NONE, raw.size()) + raw;
+}
+
+bool is_encoded_node_image(const char *data, size_t len)
+{
+  return len >= NODE_IMAGE_HEADER_SIZE && read32(data) == NODE_IMAGE_MAGIC;
+}
+
+bool decode_node_image(const char *data, size_t len, std::string &out)
+{
+  if (!is_encoded_node_image(data, len))
+    return false;
+  uint32_t codec = read32(data + 4);
+  uint64_t raw_size;
+  memcpy(&raw_size, data + 8, sizeof(raw_size));
+  data += NODE_IMAGE_HEADER_SIZE;
+  len -= NODE_IMAGE_HEADER_SIZE;
+  if (codec == NODE_CODEC_NONE && len == raw_size) {
+    out.assign(data, len);
+    return true;
+  }
+  if (codec == NODE_CODEC_LZ)
+    return decompress_buffer(data, len, raw_size, out);
+  return false;
+}
@@ -0,0 +1,40 @@
+// A small LZ77-style block compressor for serialized node images.
+
+// The format follows the LZ4 block layout: a sequence of
+// (token, literals, offset, match) records, where the token's high
+// nibble is the literal length and the low nibble is the match length
+// minus MIN_MATCH.  Lengths of 15 or more continue in extra bytes of
+// 255.  The final record carries only literals.  There is no framing:
+// callers must remember the uncompressed size.
+
+// This is not meant to compete with a real LZ4, just to be fast enough
+// that compressing an evicted node is cheaper than writing it out.
+
+#ifndef COMPRESSION_HPP
+#define COMPRESSION_HPP
+
+#include <cstddef>
+#include <string>
+
+std::string compress_buffer(const char *src, size_t len);
+std::string compress_buffer(const std::string &src);
+
+// Returns false if the input is malformed or does not decode to
+// exactly raw_size bytes.
+bool decompress_buffer(const char *src, size_t len, size_t raw_size, std::string &out);
+bool decompress_buffer(const std::string &src, size_t raw_size, std::string &out);
+
+// Node images written compressed to the backing store start with a
+// 16-byte header, a uint32 magic (whose first byte is 0, so it cannot
+// start a raw image), a uint32 codec and the uint64 raw size, followed
+// by the encoded bytes.  Images without the header are raw.
+#define NODE_CODEC_NONE (0)
+#define NODE_CODEC_LZ (1)
+
+// Uses NODE_CODEC_NONE if compressing does not shrink the image.
+std::string encode_node_image(const std::string &raw);
+bool is_encoded_node_image(const char *data, size_t len);
+// Returns false if the image is corrupt.
+bool decode_node_image(const char *data, size_t len, std::string &out);
+
+#endif // COMPRESSION_HPP
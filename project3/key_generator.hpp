@@ -0,0 +1,218 @@
+// Key distributions for the benchmarks.  A key_generator draws keys
+// in [0, nkeys) from a distribution; the randomness comes from a
+// fast_rng that the caller owns, so each thread can have its own and
+// share one generator.
+//
+// Distributions, as given to create():
+//   uniform
+//   zipfian[:theta]                Key 0 is the most popular
+//   scrambled[:theta]              Zipfian, with popular keys scattered
+//   latest[:theta]                 Zipfian, with the newest key the most popular
+//   hotspot[:hot_keys[:hot_ops]]   A fraction hot_ops of the draws go to
+//                                  the first hot_keys fraction of keys
+// The zipfian ones follow YCSB (Gray et al., "Quickly generating
+// billion-record synthetic databases").
+
+#ifndef KEY_GENERATOR_HPP
+#define KEY_GENERATOR_HPP
+
+#include <cstdint>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+#include <sstream>
+#include <vector>
+
+#define DEFAULT_ZIPFIAN_THETA (0.99)
+#define DEFAULT_HOTSPOT_KEYS (0.2)
+#define DEFAULT_HOTSPOT_OPS (0.8)
+
+// xorshift64*, seeded through splitmix64 so that nearby seeds give
+// unrelated streams.
+class fast_rng {
+public:
+  fast_rng(uint64_t seed) {
+    state = seed + 0x9e3779b97f4a7c15ULL;
+    state = (state ^ (state >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    state = (state ^ (state >> 27)) * 0x94d049bb133111ebULL;
+    state ^= state >> 31;
+    if (state == 0)
+      state = 1;
+  }
+
+  uint64_t next(void) {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545f4914f6cdd1dULL;
+  }
+
+  // In [0, n), by multiplying rather than dividing.
+  uint64_t uniform(uint64_t n) {
+    return (uint64_t)(((unsigned __int128)next() * n) >> 64);
+  }
+
+  // In [0, 1)
+  double uniform_double(void) {
+    return (next() >> 11) * (1.0 / (1ULL << 53));
+  }
+
+private:
+  uint64_t state;
+};
+
+class key_generator {
+public:
+  key_generator(uint64_t nkeys) : nkeys(nkeys) {}
+  virtual ~key_generator(void) {}
+
+  virtual uint64_t next(fast_rng &rng) = 0;
+
+  // Keys up to nkeys exist now, e.g. after inserts.
+  virtual void grow(uint64_t nkeys) { this->nkeys = nkeys; }
+
+  uint64_t size(void) const { return nkeys; }
+
+  // Returns NULL if spec is not one of the distributions above.
+  static key_generator * create(const std::string &spec, uint64_t nkeys);
+
+protected:
+  uint64_t nkeys;
+};
+
+class uniform_key_generator : public key_generator {
+public:
+  uniform_key_generator(uint64_t nkeys) : key_generator(nkeys) {}
+
+  uint64_t next(fast_rng &rng) {
+    return rng.uniform(nkeys);
+  }
+};
+
+class zipfian_key_generator : public key_generator {
+public:
+  zipfian_key_generator(uint64_t nkeys, double theta) :
+    key_generator(0),
+    theta(theta),
+    alpha(1.0 / (1.0 - theta)),
+    zeta2(1.0 + pow(0.5, theta)),
+    zetan(0)
+  {
+    grow(nkeys);
+  }
+
+  uint64_t next(fast_rng &rng) {
+    double u = rng.uniform_double();
+    double uz = u * zetan;
+    if (uz < 1.0)
+      return 0;
+    if (uz < zeta2)
+      return 1;
+    uint64_t key = nkeys * pow(eta * u - eta + 1.0, alpha);
+    return key < nkeys ? key : nkeys - 1;
+  }
+
+  // zeta(n) is a sum over all keys, so it is extended rather than
+  // recomputed as keys are added.
+  void grow(uint64_t n) {
+    for (uint64_t i = nkeys + 1; i <= n; i++)
+      zetan += 1.0 / pow(i, theta);
+    nkeys = n;
+    eta = (1.0 - pow(2.0 / nkeys, 1.0 - theta)) / (1.0 - zeta2 / zetan);
+  }
+
+private:
+  const double theta;
+  const double alpha;
+  const double zeta2;
+  double zetan;
+  double eta;
+};
+
+class scrambled_zipfian_key_generator : public zipfian_key_generator {
+public:
+  scrambled_zipfian_key_generator(uint64_t nkeys, double theta) :
+    zipfian_key_generator(nkeys, theta)
+  {}
+
+  // FNV-1a over the bytes of the rank.
+  uint64_t next(fast_rng &rng) {
+    uint64_t rank = zipfian_key_generator::next(rng);
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < 8; i++) {
+      hash ^= (rank >> (8 * i)) & 0xff;
+      hash *= 0x100000001b3ULL;
+    }
+    return hash % nkeys;
+  }
+};
+
+class latest_key_generator : public zipfian_key_generator {
+public:
+  latest_key_generator(uint64_t nkeys, double theta) :
+    zipfian_key_generator(nkeys, theta)
+  {}
+
+  uint64_t next(fast_rng &rng) {
+    return nkeys - 1 - zipfian_key_generator::next(rng);
+  }
+};
+
+class hotspot_key_generator : public key_generator {
+public:
+  hotspot_key_generator(uint64_t nkeys, double hot_keys, double hot_ops) :
+    key_generator(nkeys),
+    hot_keys(hot_keys),
+    hot_ops(hot_ops)
+  {}
+
+  uint64_t next(fast_rng &rng) {
+    uint64_t hot = nkeys * hot_keys;
+    if (hot == 0)
+      hot = 1;
+    if (hot >= nkeys || rng.uniform_double() < hot_ops)
+      return rng.uniform(hot < nkeys ? hot : nkeys);
+    return hot + rng.uniform(nkeys - hot);
+  }
+
+private:
+  const double hot_keys;
+  const double hot_ops;
+};
+
+inline key_generator * key_generator::create(const std::string &spec, uint64_t nkeys)
+{
+  std::string name;
+  std::vector<double> params;
+  std::istringstream in(spec);
+  std::getline(in, name, ':');
+  std::string param;
+  while (std::getline(in, param, ':')) {
+    char *term;
+    params.push_back(strtod(param.c_str(), &term));
+    if (param.empty() || *term)
+      return NULL;
+  }
+
+  if (nkeys == 0)
+    return NULL;
+  double theta = params.size() > 0 ? params[0] : DEFAULT_ZIPFIAN_THETA;
+  bool zipfian_ok = params.size() <= 1 && theta > 0 && theta < 1;
+  if (name == "uniform" && params.empty())
+    return new uniform_key_generator(nkeys);
+  if (name == "zipfian" && zipfian_ok)
+    return new zipfian_key_generator(nkeys, theta);
+  if (name == "scrambled" && zipfian_ok)
+    return new scrambled_zipfian_key_generator(nkeys, theta);
+  if (name == "latest" && zipfian_ok)
+    return new latest_key_generator(nkeys, theta);
+  if (name == "hotspot" && params.size() <= 2) {
+    double hot_keys = params.size() > 0 ? params[0] : DEFAULT_HOTSPOT_KEYS;
+    double hot_ops = params.size() > 1 ? params[1] : DEFAULT_HOTSPOT_OPS;
+    if (hot_keys > 0 && hot_keys <= 1 && hot_ops >= 0 && hot_ops <= 1)
+      return new hotspot_key_generator(nkeys, hot_keys, hot_ops);
+  }
+  return NULL;
+}
+
+#endif // KEY_GENERATOR_HPP
@@ -0,0 +1,107 @@
+// A log-bucketed latency histogram in the style of HdrHistogram.
+// Values below 2^LATENCY_SUB_BUCKET_BITS are counted exactly; above
+// that, every power of two is split into 2^(LATENCY_SUB_BUCKET_BITS-1)
+// buckets, so a recorded value is off by at most 1 part in 64.
+// Recording is a few instructions and the whole uint64_t range fits
+// in a fixed array.
+
+#ifndef LATENCY_HISTOGRAM_HPP
+#define LATENCY_HISTOGRAM_HPP
+
+#include <cstdint>
+#include <cmath>
+#include <ctime>
+#include <vector>
+#include <algorithm>
+
+#define LATENCY_SUB_BUCKET_BITS (7)
+
+// For timing single operations.
+inline uint64_t monotonic_ns(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+class latency_histogram {
+public:
+  latency_histogram(void) :
+    counts(bucket_index(UINT64_MAX) + 1, 0),
+    total(0),
+    sum(0),
+    min_value(UINT64_MAX),
+    max_value(0)
+  {}
+
+  void record(uint64_t value) {
+    counts[bucket_index(value)]++;
+    total++;
+    sum += value;
+    min_value = std::min(min_value, value);
+    max_value = std::max(max_value, value);
+  }
+
+  void merge(const latency_histogram &other) {
+    for (size_t i = 0; i < counts.size(); i++)
+      counts[i] += other.counts[i];
+    total += other.total;
+    sum += other.sum;
+    min_value = std::min(min_value, other.min_value);
+    max_value = std::max(max_value, other.max_value);
+  }
+
+  void reset(void) {
+    std::fill(counts.begin(), counts.end(), 0);
+    total = sum = max_value = 0;
+    min_value = UINT64_MAX;
+  }
+
+  uint64_t count(void) const { return total; }
+  uint64_t min(void) const { return total ? min_value : 0; }
+  uint64_t max(void) const { return max_value; }
+  double mean(void) const { return total ? (double)sum / total : 0; }
+
+  // The smallest value that at least p percent of the recorded ones
+  // are no greater than, to within the bucket width.
+  uint64_t percentile(double p) const {
+    if (total == 0)
+      return 0;
+    uint64_t rank = std::max<uint64_t>(1, ceil(p / 100.0 * total));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); i++) {
+      seen += counts[i];
+      if (seen >= rank)
+        return std::min(bucket_limit(i), max_value);
+    }
+    return max_value;
+  }
+
+private:
+  static const uint64_t sub_buckets = 1ULL << LATENCY_SUB_BUCKET_BITS;
+  static const uint64_t half = sub_buckets / 2;
+
+  static size_t bucket_index(uint64_t value) {
+    if (value < sub_buckets)
+      return value;
+    int shift = 63 - __builtin_clzll(value) - (LATENCY_SUB_BUCKET_BITS - 1);
+    return shift * half + (value >> shift);
+  }
+
+  // The largest value that lands in bucket i.
+  static uint64_t bucket_limit(size_t i) {
+    if (i < sub_buckets)
+      return i;
+    int shift = i / half - 1;
+    uint64_t low = (i % half + half) << shift;
+    return low + ((1ULL << shift) - 1);
+  }
+
+  std::vector<uint64_t> counts;
+  uint64_t total;
+  uint64_t sum;
+  uint64_t min_value;
+  uint64_t max_value;
+};
+
+#endif // LATENCY_HISTOGRAM_HPP
@@ -1,40 +1,184 @@
 #include "logger.hpp"
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <thread>
+#include <memory>
+#include <cstdio>
+#include <unistd.h>
+#include <fcntl.h>
 
-uint64_t Logger::curr_lsn = 0;
-
-Logger::Logger(const std::string& filename, uint64_t log_granularity, uint64_t checkpoint_granularity) 
-    : log_filename(filename), log_granularity(log_granularity), checkpoint_granularity(checkpoint_granularity)  // Initialize flush threshold
+Logger::Logger(const std::string& filename, uint64_t log_granularity, uint64_t checkpoint_granularity,
+               uint64_t segment_size) 
+    : log_filename(filename), segment_size(segment_size), next_segment_seq(0), segment_fd(-1), segment_offset(0),
+      log_granularity(log_granularity), checkpoint_granularity(checkpoint_granularity), next_lsn(0),  // Initialize flush threshold
+      stats()
 {
-    log_file.open(log_filename, std::ofstream::out | std::ofstream::app);
-    if (!log_file.is_open()) {
-        throw std::runtime_error("Unable to open log file: " + filename);
+    // Continue numbering after whatever is in the log and whatever
+    // the manifest says was handed out before, so old and new records
+    // (including stale ones in recycled segments) are never confused.
+    read_manifest(log_filename, next_lsn, live_segments, free_segments);
+    for (const auto& segment : live_segments) {
+        next_segment_seq = std::max(next_segment_seq, segment.seq + 1);
+    }
+    for (uint64_t seq : free_segments) {
+        next_segment_seq = std::max(next_segment_seq, seq + 1);
+    }
+    // Every manifest write records next_lsn, which is never below the
+    // first LSN of the last live segment, so only the records in that
+    // segment can be newer.  Recovery reads the rest.
+    if (!live_segments.empty()) {
+        std::vector<Logger::LogRecord> tail;
+        read_segment(log_filename, live_segments.back(), 1, tail);
+        next_lsn = std::max(next_lsn, live_segments.back().first_lsn);
+        if (!tail.empty()) {
+            next_lsn = std::max(next_lsn, tail.back().lsn + 1);
+        }
     }
 
+    // Never append to a segment from a previous run: its tail may be
+    // a half-written record.  Start a fresh one instead.
+    start_segment(next_lsn);
 }
 
 Logger::~Logger() {
     flush(); // Ensure all logs are written to file when the logger is destroyed
-    log_file.close();
+    if (segment_fd >= 0) {
+        close(segment_fd);
+    }
 }
 
 void Logger::log(const Logger::LogRecord& record) {
+    std::unique_lock<std::mutex> lock(log_lock);
     log_buffer.push_back(record);  // Add the log record to the buffer
+    log_buffer.back().lsn = next_lsn++;
     if (log_buffer.size() >= log_granularity) {
+        lock.unlock();
         flush();  // Flush to disk if the buffer size exceeds the threshold
     }
 }
 
 void Logger::flush() {
-    // Write each log record to the file
+    std::unique_lock<std::mutex> lock(log_lock);
+    // Write the records to the current segment, moving on to a new
+    // one whenever the next record would not fit.
+    std::string data;
     for (const auto& record : log_buffer) {
-        log_file << record.serialize() << std::endl;
+        std::string line = frame(record.serialize());
+        if (segment_offset + data.size() + line.size() > segment_size &&
+            segment_offset + data.size() > 0) {
+            if (!data.empty()) {
+                if (pwrite(segment_fd, data.data(), data.size(), segment_offset) != (ssize_t)data.size()) {
+                    throw std::runtime_error("Unable to write log segment");
+                }
+                stats.writes++;
+                stats.bytes_written += data.size();
+            }
+            start_segment(record.lsn);
+            data.clear();
+        }
+        data += line;
+    }
+    if (!data.empty()) {
+        if (pwrite(segment_fd, data.data(), data.size(), segment_offset) != (ssize_t)data.size()) {
+            throw std::runtime_error("Unable to write log segment");
+        }
+        segment_offset += data.size();
+        stats.writes++;
+        stats.bytes_written += data.size();
     }
-    log_file.flush();
+    stats.records += log_buffer.size();
     log_buffer.clear();  // Clear the buffer after flushing
 }
 
+std::string Logger::segment_filename(uint64_t seq) const {
+    return log_filename + "." + std::to_string(seq);
+}
+
+// Switch writing to a new segment whose first record will be
+// first_lsn.  A retired segment is recycled if there is one, otherwise
+// a new file is preallocated.
+void Logger::start_segment(uint64_t first_lsn) {
+    if (segment_fd >= 0) {
+        close(segment_fd);
+    }
+    uint64_t seq = next_segment_seq++;
+    std::string filename = segment_filename(seq);
+    if (!free_segments.empty()) {
+        rename(segment_filename(free_segments.back()).c_str(), filename.c_str());
+        free_segments.pop_back();
+        segment_fd = open(filename.c_str(), O_WRONLY);
+        stats.segments_recycled++;
+    } else {
+        segment_fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (segment_fd >= 0 && posix_fallocate(segment_fd, 0, segment_size) != 0) {
+            ftruncate(segment_fd, segment_size);
+        }
+        stats.segments_created++;
+    }
+    if (segment_fd < 0) {
+        throw std::runtime_error("Unable to open log segment: " + filename);
+    }
+    segment_offset = 0;
+    live_segments.push_back(Segment{seq, first_lsn});
+    write_manifest();
+}
+
+// Move every segment that only holds records below lsn to the free
+// list.  The segment being written is never retired.
+void Logger::retire_segments_before(uint64_t lsn) {
+    while (live_segments.size() > 1 && live_segments[1].first_lsn <= lsn) {
+        uint64_t seq = live_segments.front().seq;
+        live_segments.pop_front();
+        if (free_segments.size() < MAX_FREE_LOG_SEGMENTS) {
+            free_segments.push_back(seq);
+        } else {
+            unlink(segment_filename(seq).c_str());
+        }
+    }
+}
+
+// The manifest is small, so it is rewritten through a temp file.
+void Logger::write_manifest() {
+    std::string temp_filename = log_filename + ".tmp";
+    std::ofstream out(temp_filename, std::ofstream::out | std::ofstream::trunc);
+    out << "next_lsn " << next_lsn << std::endl;
+    for (const auto& segment : live_segments) {
+        out << "live " << segment.seq << " " << segment.first_lsn << std::endl;
+    }
+    for (uint64_t seq : free_segments) {
+        out << "free " << seq << std::endl;
+    }
+    out.close();
+    if (!out) {
+        throw std::runtime_error("Unable to write log manifest: " + log_filename);
+    }
+    rename(temp_filename.c_str(), log_filename.c_str());
+    stats.manifest_writes++;
+}
+
+void Logger::read_manifest(const std::string& filename, uint64_t& next_lsn,
+                           std::deque<Segment>& live, std::vector<uint64_t>& free) {
+    std::ifstream in(filename);
+    std::string kind;
+    while (in >> kind) {
+        if (kind == "next_lsn") {
+            in >> next_lsn;
+        } else if (kind == "live") {
+            Segment segment;
+            in >> segment.seq >> segment.first_lsn;
+            live.push_back(segment);
+        } else if (kind == "free") {
+            uint64_t seq;
+            in >> seq;
+            free.push_back(seq);
+        } else {
+            std::string rest;
+            std::getline(in, rest);
+        }
+    }
+}
+
 std::vector<Logger::LogRecord> Logger::get_log_entries() {
     return log_buffer;  
 }
@@ -43,13 +187,228 @@ std::vector<Logger::LogRecord>& Logger::get_log_buffer() {
     return log_buffer;  
 }
 
+// Everything logged so far is covered by the checkpoint.
 void Logger::clear_log_on_disk() {
-    // Close
-    if (log_file.is_open()) {
-       log_file.close(); 
+    std::unique_lock<std::mutex> lock(log_lock);
+    if (segment_offset > 0) {
+        start_segment(next_lsn);
+    }
+    retire_segments_before(next_lsn);
+    write_manifest();
+}
+
+uint64_t Logger::get_next_lsn() {
+    std::unique_lock<std::mutex> lock(log_lock);
+    return next_lsn;
+}
+
+// The log can be empty after a checkpoint, so recovery passes in the
+// checkpoint's LSN to keep numbering monotonic across restarts.
+void Logger::advance_lsn(uint64_t lsn) {
+    std::unique_lock<std::mutex> lock(log_lock);
+    if (lsn > next_lsn) {
+        next_lsn = lsn;
     }
-    // Empty
-    log_file.open(log_filename, std::ofstream::out | std::ofstream::trunc);
+}
+
+// Retire the segments a finished checkpoint already covers.  The
+// segment holding lsn stays, along with any older records in it;
+// recovery skips those by LSN.
+void Logger::truncate_log_before(uint64_t lsn) {
+    std::unique_lock<std::mutex> lock(log_lock);
+    retire_segments_before(lsn);
+    write_manifest();
+}
+
+// Returns UINT64_MAX if the line has no lsn.
+uint64_t Logger::parse_lsn(const std::string& line) {
+    size_t pos = line.find("\"lsn\":");
+    if (pos == std::string::npos) {
+        return UINT64_MAX;
+    }
+    try {
+        return std::stoull(line.substr(pos + 6));
+    } catch (std::exception& e) {
+        return UINT64_MAX;
+    }
+}
+
+// Standard CRC-32 (the one zlib uses), bitwise table built on first use.
+uint32_t Logger::crc32(const std::string& data) {
+    static const std::vector<uint32_t> table = [] {
+        std::vector<uint32_t> t(256);
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+    uint32_t crc = 0xFFFFFFFFu;
+    for (unsigned char c : data) {
+        crc = table[(crc ^ c) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+// A record goes to disk as "<length> <crc> <body>\n", where the CRC
+// covers the whole body, LSN included.
+std::string Logger::frame(const std::string& body) {
+    char header[32];
+    snprintf(header, sizeof(header), "%zu %08x ", body.size(), crc32(body));
+    return header + body + "\n";
+}
+
+// Returns false for anything that is not a whole record, such as a
+// line torn by a crash, or one whose start was overwritten by a torn
+// append after its segment was recycled.
+bool Logger::parse_record(const std::string& framed, Logger::LogRecord& record) {
+    size_t length_end = framed.find(' ');
+    if (length_end == std::string::npos || length_end + 10 > framed.size() ||
+        framed[length_end + 9] != ' ') {
+        return false;
+    }
+    std::string line = framed.substr(length_end + 10);
+    try {
+        if (std::stoull(framed.substr(0, length_end)) != line.size() ||
+            std::stoul(framed.substr(length_end + 1, 8), nullptr, 16) != crc32(line)) {
+            return false;
+        }
+    } catch (std::exception& e) {
+        return false;
+    }
+    size_t op = line.find("\"operation\":");
+    size_t key = line.find("\"key\":");
+    size_t value = line.find("\"value\":\"");
+    size_t timestamp = line.find("\"timestamp\":");
+    if (op == std::string::npos || key == std::string::npos ||
+        value == std::string::npos || timestamp == std::string::npos ||
+        line.empty() || line.back() != '}') {
+        return false;
+    }
+    size_t value_start = value + 9;
+    size_t value_end = line.find("\"", value_start);
+    if (value_end == std::string::npos) {
+        return false;
+    }
+    record.lsn = parse_lsn(line);
+    try {
+        record.opcode = std::stoi(line.substr(op + 12));
+        record.key = std::stoull(line.substr(key + 6));
+        record.value = line.substr(value_start, value_end - value_start);
+        record.timestamp = std::stoull(line.substr(timestamp + 12));
+    } catch (std::exception& e) {
+        return false;
+    }
+    return true;
+}
+
+// Stops at the first record that does not check out; *complete says
+// whether the whole chunk was parsed.
+void Logger::parse_chunk(const char* begin, const char* end, std::vector<Logger::LogRecord>* records,
+                         bool* complete) {
+    *complete = false;
+    while (begin < end) {
+        const char* eol = std::find(begin, end, '\n');
+        Logger::LogRecord record;
+        if (!parse_record(std::string(begin, eol), record)) {
+            return;
+        }
+        records->push_back(record);
+        begin = eol + 1;
+    }
+    *complete = true;
+}
+
+// Parse the valid records at the start of a segment.  A new segment
+// ends in preallocated zeros; a recycled one may continue with stale
+// records, which are older than first_lsn, or with a record whose
+// start a torn append overwrote, which fails its CRC.
+void Logger::parse_segment(const std::string& contents, uint64_t first_lsn, unsigned nthreads,
+                           std::vector<Logger::LogRecord>& records) {
+    const char* data = contents.data();
+    const char* end = std::find(data, data + contents.size(), '\0');
+    size_t size = end - data;
+
+    // Small segments are not worth a thread per core.
+    nthreads = std::min<size_t>(nthreads, size / (1 << 16) + 1);
+
+    std::vector<const char*> bounds(1, data);
+    for (unsigned i = 1; i < nthreads; i++) {
+        const char* b = std::max(bounds.back(), data + size * i / nthreads);
+        b = std::find(b, end, '\n');
+        bounds.push_back(b == end ? end : b + 1);
+    }
+    bounds.push_back(end);
+
+    std::vector<std::vector<Logger::LogRecord> > chunks(nthreads);
+    std::unique_ptr<bool[]> complete(new bool[nthreads]);
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < nthreads; i++) {
+        threads.push_back(std::thread(parse_chunk, bounds[i], bounds[i + 1], &chunks[i], &complete[i]));
+    }
+    parse_chunk(bounds[0], bounds[1], &chunks[0], &complete[0]);
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    // LSNs only go up, so the first one that does not marks the end,
+    // as does the first record that fails its length or CRC check.
+    uint64_t last_lsn = first_lsn;
+    bool first = true;
+    for (unsigned i = 0; i < nthreads; i++) {
+        for (auto& record : chunks[i]) {
+            if (record.lsn == UINT64_MAX || record.lsn < first_lsn ||
+                (!first && record.lsn <= last_lsn)) {
+                return;
+            }
+            records.push_back(record);
+            last_lsn = record.lsn;
+            first = false;
+        }
+        if (!complete[i]) {
+            return;
+        }
+    }
+}
+
+std::vector<Logger::LogRecord> Logger::read_log(const std::string& filename, unsigned nthreads) {
+    std::vector<Logger::LogRecord> records;
+    uint64_t next_lsn = 0;
+    std::deque<Segment> live;
+    std::vector<uint64_t> free;
+    read_manifest(filename, next_lsn, live, free);
+
+    if (nthreads == 0) {
+        nthreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    for (const auto& segment : live) {
+        read_segment(filename, segment, nthreads, records);
+    }
+    return records;
+}
+
+void Logger::read_segment(const std::string& filename, const Segment& segment, unsigned nthreads,
+                          std::vector<Logger::LogRecord>& records) {
+    std::ifstream in(filename + "." + std::to_string(segment.seq),
+                     std::ifstream::in | std::ifstream::binary);
+    if (!in.is_open()) {
+        return;
+    }
+    in.seekg(0, std::ifstream::end);
+    std::string contents(in.tellg(), '\0');
+    in.seekg(0, std::ifstream::beg);
+    in.read(&contents[0], contents.size());
+    in.close();
+    parse_segment(contents, segment.first_lsn, nthreads, records);
+}
+
+Logger::Stats Logger::get_stats() {
+    std::unique_lock<std::mutex> lock(log_lock);
+    return stats;
 }
 
 uint64_t Logger::get_checkpoint_granularity() {
@@ -57,13 +416,6 @@ uint64_t Logger::get_checkpoint_granularity() {
 }
 
 void Logger::print_log_on_disk() {
-    std::string line;
-    int count = 0;
-    std::ifstream file(log_filename);
     std::cout << "Printing log file" << std::endl;
-    while (std::getline(file, line)) {
-        count++;
-        // std::cout << line << std::endl;
-    }
-    std::cout << count << std::endl;
+    std::cout << read_log(log_filename).size() << std::endl;
 }
@@ -6,6 +6,14 @@
 #include <vector>
 #include <stdexcept>
 #include <cstdint>
+#include <mutex>
+#include <deque>
+
+// The log is a series of fixed-size segment files, <log>.<seq>, listed
+// in a manifest kept in the log file itself.  Checkpoints retire whole
+// segments, which are recycled (renamed) for new ones.
+#define DEFAULT_LOG_SEGMENT_SIZE (1ULL << 20)
+#define MAX_FREE_LOG_SEGMENTS (4)
 
 //enum OperationType {
 //    INSERT, // 0
@@ -21,37 +29,89 @@ public:
         uint64_t key;           
         std::string value;      
         uint64_t timestamp;     
+        uint64_t lsn;  // Assigned by log(); UINT64_MAX if read from a record without one
 
         // How it will be written to txt file - JSON format for readability
         std::string serialize() const {
-            return "{\"lsn\":" + std::to_string(curr_lsn++) + 
+            return "{\"lsn\":" + std::to_string(lsn) + 
                 ",\"operation\":" + std::to_string(opcode) +
                 ", \"key\":" + std::to_string(key) +
                 ", \"value\":\"" + value +
                 "\", \"timestamp\":" + std::to_string(timestamp) + "}";
         }
     };
-    Logger(const std::string& filename, uint64_t log_granularity = 10, uint64_t checkpoint_granularity = 1000);  // Make flush_threshold configurable
+    Logger(const std::string& filename, uint64_t log_granularity = 10, uint64_t checkpoint_granularity = 1000,
+           uint64_t segment_size = DEFAULT_LOG_SEGMENT_SIZE);  // Make flush_threshold configurable
     ~Logger();
     
     void log(const Logger::LogRecord& record);
     void flush();  // Flush current buffer to file
-    void clear_log_on_disk();  // Clear log buffer after checkpoint
+    void clear_log_on_disk();  // Retire every segment after a checkpoint
+    uint64_t get_next_lsn();   // LSN the next logged record will get
+    void advance_lsn(uint64_t lsn);  // Never hand out an LSN below lsn
+    void truncate_log_before(uint64_t lsn);  // Retire segments holding only records older than lsn
     
     std::vector<Logger::LogRecord>& get_log_buffer(); // Get log buffer for external use
 	std::vector<Logger::LogRecord> get_log_entries();
     uint64_t get_checkpoint_granularity();
+
+    // Totals since the Logger was created.  Bytes are what went to
+    // the segment files; writes counts the pwrite()s that carried them.
+    struct Stats {
+        uint64_t records;
+        uint64_t bytes_written;
+        uint64_t writes;
+        uint64_t segments_created;
+        uint64_t segments_recycled;
+        uint64_t manifest_writes;
+    };
+    Stats get_stats();
+
+    // Every complete record in a log, in log order.  Each segment is
+    // read in one go and split into line-aligned chunks that are
+    // parsed on up to nthreads threads (0 means one per core).
+    static std::vector<Logger::LogRecord> read_log(const std::string& filename, unsigned nthreads = 0);
     void clear_log();                    
     void print_log_on_disk();
 
 
 private:
-    std::string log_filename;
-    std::ofstream log_file;
+    struct Segment {
+        uint64_t seq;
+        uint64_t first_lsn;  // Records in the file below this are stale, left from before it was recycled
+    };
+
+    std::string log_filename;  // The manifest
+    const uint64_t segment_size;
+    std::deque<Segment> live_segments;  // Oldest first; the last one is being written
+    std::vector<uint64_t> free_segments;
+    uint64_t next_segment_seq;
+    int segment_fd;
+    uint64_t segment_offset;
     std::vector<Logger::LogRecord> log_buffer;
     const uint64_t log_granularity;  // Flush threshold, configurable through the constructor
     const uint64_t checkpoint_granularity;
-    static u_int64_t curr_lsn;
+    uint64_t next_lsn;  // Persistent: continues from the log and the checkpoint
+    std::mutex log_lock;  // Fuzzy checkpoints truncate the log from a background thread
+    Stats stats;  // Protected by log_lock
+
+    void start_segment(uint64_t first_lsn);
+    void retire_segments_before(uint64_t lsn);
+    void write_manifest();
+    std::string segment_filename(uint64_t seq) const;
+    static void read_manifest(const std::string& filename, uint64_t& next_lsn,
+                              std::deque<Segment>& live, std::vector<uint64_t>& free);
+    static void read_segment(const std::string& filename, const Segment& segment, unsigned nthreads,
+                             std::vector<Logger::LogRecord>& records);
+    static void parse_segment(const std::string& contents, uint64_t first_lsn, unsigned nthreads,
+                              std::vector<Logger::LogRecord>& records);
+
+    static uint32_t crc32(const std::string& data);
+    static std::string frame(const std::string& body);
+    static uint64_t parse_lsn(const std::string& line);
+    static bool parse_record(const std::string& framed, Logger::LogRecord& record);
+    static void parse_chunk(const char* begin, const char* end, std::vector<Logger::LogRecord>* records,
+                            bool* complete);
 };
 
 #endif
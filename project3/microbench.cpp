@@ -0,0 +1,398 @@
+// Microbenchmarks for the per-node hot paths of the betree: node
+// serialization and deserialization, node::apply, node::split,
+// node::flush into an in-memory leaf and get_pivot lookups.  Nodes
+// are only ever held in memory, behind a backing store that aborts if
+// it is used, so the numbers have no I/O in them.  Each benchmark is
+// run a number of times to warm up, then measured; it reports the
+// mean time and the number of heap allocations per operation.
+//
+// The tree the nodes belong to is built in a scratch directory that
+// is removed on exit.
+
+#include <unistd.h>
+#include <dirent.h>
+#include <cstdlib>
+#include <cstdio>
+#include <atomic>
+#include <new>
+#include <vector>
+#include <fstream>
+#include "betree.hpp"
+#include "key_generator.hpp"
+#include "latency_histogram.hpp"
+
+#define DEFAULT_MICROBENCH_NODE_SIZE (1024)
+#define DEFAULT_MICROBENCH_FLUSH_SIZE (DEFAULT_MICROBENCH_NODE_SIZE / 16)
+#define DEFAULT_MICROBENCH_VALUE_SIZE (100)
+#define DEFAULT_MICROBENCH_WARMUP (100)
+#define DEFAULT_MICROBENCH_REPETITIONS (1000)
+// Operations timed together, for the ones too short to time singly
+#define MICROBENCH_BATCH (100)
+
+// Every heap allocation goes through here.  (Kept out of line so gcc
+// doesn't see the free() of a pointer from operator new.)
+static std::atomic<uint64_t> allocations(0);
+
+__attribute__((noinline)) void * operator new(size_t size)
+{
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  void *p = malloc(size ? size : 1);
+  if (p == NULL)
+    throw std::bad_alloc();
+  return p;
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+  free(p);
+}
+
+// Nothing here should reach the disk.
+class null_backing_store : public backing_store {
+public:
+  void allocate(uint64_t obj_id, uint64_t version) { touched(); }
+  void deallocate(uint64_t obj_id, uint64_t version) {}
+  std::iostream * get(uint64_t obj_id, uint64_t version) { touched(); return NULL; }
+  void put(std::iostream *ios) { touched(); }
+  void list_versions(std::vector<std::pair<uint64_t, uint64_t> > &stored) {}
+
+private:
+  static void touched(void) {
+    std::cerr << "microbench: a node reached the backing store" << std::endl;
+    abort();
+  }
+};
+
+// Runs op warmup times and then repetitions times, each time after
+// setup and followed by teardown, and times only op.  op does
+// ops_per_repetition operations.
+template<class Setup, class Op, class Teardown>
+void run(const char *name, uint64_t warmup, uint64_t repetitions, uint64_t ops_per_repetition,
+	 Setup setup, Op op, Teardown teardown)
+{
+  for (uint64_t i = 0; i < warmup; i++) {
+    setup();
+    op();
+    teardown();
+  }
+  uint64_t ns = 0;
+  uint64_t allocated = 0;
+  for (uint64_t i = 0; i < repetitions; i++) {
+    setup();
+    uint64_t before = allocations.load(std::memory_order_relaxed);
+    uint64_t start = monotonic_ns();
+    op();
+    ns += monotonic_ns() - start;
+    allocated += allocations.load(std::memory_order_relaxed) - before;
+    teardown();
+  }
+  uint64_t ops = repetitions * ops_per_repetition;
+  printf("%-20s %12.1f %10.2f\n", name, (1.0*ns)/ops, (1.0*allocated)/ops);
+}
+
+static void nothing(void) {}
+
+class node_benchmark {
+public:
+  typedef betree<uint64_t, std::string> tree;
+  typedef tree::node node;
+  typedef tree::node_pointer node_pointer;
+  typedef tree::message_map message_map;
+  typedef tree::pivot_map pivot_map;
+  typedef tree::child_info child_info;
+
+  // Leaves hold node_size/2 messages, as after a split, and internal
+  // nodes node_size/16 children and node_size/2 buffered messages.
+  // Keys are spaced KEY_SPACING apart.
+  node_benchmark(tree &b, swap_space &ss, uint64_t node_size, uint64_t flush_size,
+		 uint64_t value_size, uint64_t seed) :
+    b(b),
+    ss(ss),
+    node_size(node_size),
+    flush_size(flush_size),
+    value_size(value_size),
+    rng(seed),
+    timestamp(1)
+  {
+    make_messages(leaf.elements, node_size / 2);
+    make_messages(internal.elements, node_size / 2);
+    for (uint64_t i = 0; i < std::max<uint64_t>(2, node_size / 16); i++)
+      add_child(internal, i * (node_size / 2) * KEY_SPACING / std::max<uint64_t>(2, node_size / 16));
+    for (uint64_t i = 0; i < node_size; i++)
+      add_child(pivots, i * KEY_SPACING);
+  }
+
+  void run_all(uint64_t warmup, uint64_t repetitions) {
+    std::string image;
+    node *n = NULL;
+    pivot_map split;
+    node_pointer child;
+    message_map batch;
+    std::vector<std::pair<MessageKey<uint64_t>, Message<std::string> > > messages;
+    std::vector<uint64_t> keys;
+
+    printf("# leaf image: %ld bytes, internal image: %ld bytes\n",
+	   serialize_node(leaf).size(), serialize_node(internal).size());
+    printf("# operation                 ns/op  allocs/op\n");
+
+    run("serialize-leaf", warmup, repetitions, 1,
+	nothing,
+	[&] { image = serialize_node(leaf); },
+	nothing);
+
+    image = serialize_node(leaf);
+    run("deserialize-leaf", warmup, repetitions, 1,
+	nothing,
+	[&] { n = deserialize_node(image); },
+	[&] { delete n; });
+
+    run("serialize-internal", warmup, repetitions, 1,
+	nothing,
+	[&] { image = serialize_node(internal); },
+	nothing);
+
+    // A deserialized internal node took over its children's
+    // references from the image, which still belong to internal.
+    image = serialize_node(internal);
+    run("deserialize-internal", warmup, repetitions, 1,
+	nothing,
+	[&] { n = deserialize_node(image); },
+	[&] {
+	  for (auto &it : n->pivots)
+	    it.second.child.set_target(0);
+	  delete n;
+	});
+
+    // Inserts replace a message already in the leaf, so it stays the
+    // same size.
+    run("apply-insert", warmup, repetitions, MICROBENCH_BATCH,
+	[&] { make_batch(messages, INSERT, value_size); },
+	[&] {
+	  for (auto &m : messages)
+	    leaf.apply(b, m.first, m.second);
+	},
+	nothing);
+
+    // Updates append a byte to the old value.
+    run("apply-update", warmup, repetitions, MICROBENCH_BATCH,
+	[&] { make_batch(messages, UPDATE, 1); },
+	[&] {
+	  for (auto &m : messages)
+	    leaf.apply(b, m.first, m.second);
+	},
+	nothing);
+
+    run("split-leaf", warmup, repetitions, 1,
+	[&] {
+	  n = new node();
+	  make_messages(n->elements, node_size);
+	},
+	[&] { split = n->split(b); },
+	[&] {
+	  split.clear();
+	  delete n;
+	});
+
+    // A batch of flush_size messages for keys already in the leaf
+    run("flush-to-leaf", warmup, repetitions, 1,
+	[&] {
+	  child = ss.allocate(new node());
+	  child->elements = leaf.elements;
+	  batch.clear();
+	  make_batch(messages, INSERT, value_size, flush_size);
+	  batch.insert(messages.begin(), messages.end());
+	},
+	[&] {
+	  pivot_map result = child->flush(b, batch);
+	  assert(result.empty());
+	},
+	[&] { child = node_pointer(); });
+
+    run("get-pivot", warmup, repetitions, MICROBENCH_BATCH,
+	[&] {
+	  keys.clear();
+	  for (uint64_t i = 0; i < MICROBENCH_BATCH; i++)
+	    keys.push_back(rng.uniform(node_size * KEY_SPACING));
+	},
+	[&] {
+	  uint64_t sum = 0;
+	  for (uint64_t k : keys)
+	    sum += pivots.get_pivot(k)->first;
+	  if (sum == 1)
+	    printf("\n");
+	},
+	nothing);
+  }
+
+private:
+  static const uint64_t KEY_SPACING = 16;
+
+  // As swap_space::serialize_target() does it
+  std::string serialize_node(node &n) {
+    serialization_context ctxt(ss);
+    ctxt.keep_references = true;
+    std::stringstream out;
+    serialize(out, ctxt, n);
+    return out.str();
+  }
+
+  // As swap_space::load() does it
+  node * deserialize_node(const std::string &image) {
+    serialization_context ctxt(ss);
+    std::stringstream in(image);
+    node *n = new node();
+    deserialize(in, ctxt, *n);
+    return n;
+  }
+
+  std::string random_value(uint64_t size) {
+    std::string value(size, '\0');
+    for (char &c : value)
+      c = 'a' + rng.uniform(26);
+    return value;
+  }
+
+  void make_messages(message_map &elements, uint64_t count) {
+    elements.clear();
+    for (uint64_t i = 0; i < count; i++)
+      elements[MessageKey<uint64_t>(i * KEY_SPACING, timestamp++)] =
+	Message<std::string>(INSERT, random_value(value_size));
+  }
+
+  // Messages for keys already in leaf, in key order
+  void make_batch(std::vector<std::pair<MessageKey<uint64_t>, Message<std::string> > > &messages,
+		  int opcode, uint64_t size, uint64_t count = MICROBENCH_BATCH) {
+    std::vector<uint64_t> keys;
+    for (uint64_t i = 0; i < count; i++)
+      keys.push_back(rng.uniform(leaf.elements.size()) * KEY_SPACING);
+    std::sort(keys.begin(), keys.end());
+    messages.clear();
+    for (uint64_t k : keys)
+      messages.push_back(std::make_pair(MessageKey<uint64_t>(k, timestamp++),
+					Message<std::string>(opcode, random_value(size))));
+  }
+
+  void add_child(node &parent, uint64_t key) {
+    node_pointer child = ss.allocate(new node());
+    parent.pivots[key] = child_info(child, 0);
+  }
+
+  tree &b;
+  swap_space &ss;
+  const uint64_t node_size;
+  const uint64_t flush_size;
+  const uint64_t value_size;
+  fast_rng rng;
+  uint64_t timestamp;
+  node leaf;
+  node internal;
+  node pivots;  // node_size children and no messages
+};
+
+// A fresh place for the tree's log and version map
+static std::string make_scratch_directory(void)
+{
+  char dir[] = "/tmp/microbench.XXXXXX";
+  if (mkdtemp(dir) == NULL || chdir(dir) != 0) {
+    perror("Couldn't create a scratch directory");
+    exit(1);
+  }
+  std::ofstream master("master.log");
+  master << "LogFile:kv_store.log" << std::endl << "VersionMap:version_map.bin" << std::endl;
+  std::ofstream version_map("version_map.bin");
+  std::ofstream log("kv_store.log");
+  return dir;
+}
+
+static void remove_scratch_directory(const std::string &dir)
+{
+  DIR *d = opendir(dir.c_str());
+  if (d == NULL)
+    return;
+  struct dirent *entry;
+  while ((entry = readdir(d)) != NULL)
+    if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+      unlink((dir + "/" + entry->d_name).c_str());
+  closedir(d);
+  rmdir(dir.c_str());
+}
+
+void usage(char *name)
+{
+  std::cout
+    << "Usage: " << name << " [OPTIONS]" << std::endl
+    << "Times betree node operations in memory" << std::endl
+    << std::endl
+    << "Options are" << std::endl
+    << "    -N <max_node_size>            (in elements)     [ default: " << DEFAULT_MICROBENCH_NODE_SIZE    << " ]" << std::endl
+    << "    -f <min_flush_size>           (in elements)     [ default: " << DEFAULT_MICROBENCH_FLUSH_SIZE   << " ]" << std::endl
+    << "    -v <value_size>               (in bytes)        [ default: " << DEFAULT_MICROBENCH_VALUE_SIZE   << " ]" << std::endl
+    << "    -w <warmup_repetitions>                         [ default: " << DEFAULT_MICROBENCH_WARMUP       << " ]" << std::endl
+    << "    -r <repetitions>                                [ default: " << DEFAULT_MICROBENCH_REPETITIONS  << " ]" << std::endl
+    << "    -s <random_seed>                                [ default: 1 ]"                                     << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+  uint64_t max_node_size = DEFAULT_MICROBENCH_NODE_SIZE;
+  uint64_t min_flush_size = DEFAULT_MICROBENCH_FLUSH_SIZE;
+  uint64_t value_size = DEFAULT_MICROBENCH_VALUE_SIZE;
+  uint64_t warmup = DEFAULT_MICROBENCH_WARMUP;
+  uint64_t repetitions = DEFAULT_MICROBENCH_REPETITIONS;
+  uint64_t random_seed = 1;
+
+  int opt;
+  char *term;
+  while ((opt = getopt(argc, argv, "N:f:v:w:r:s:")) != -1) {
+    uint64_t value = optarg ? strtoull(optarg, &term, 10) : 0;
+    if (optarg && *term) {
+      std::cerr << "Argument to -" << (char)opt << " must be an integer" << std::endl;
+      usage(argv[0]);
+      exit(1);
+    }
+    switch (opt) {
+    case 'N':
+      max_node_size = value;
+      break;
+    case 'f':
+      min_flush_size = value;
+      break;
+    case 'v':
+      value_size = value;
+      break;
+    case 'w':
+      warmup = value;
+      break;
+    case 'r':
+      repetitions = value;
+      break;
+    case 's':
+      random_seed = value;
+      break;
+    default:
+      usage(argv[0]);
+      exit(1);
+    }
+  }
+  if (max_node_size < 16 || min_flush_size == 0 || min_flush_size > max_node_size / 2 ||
+      repetitions == 0) {
+    std::cerr << "Need -N of at least 16, -f between 1 and -N/2, and -r above 0" << std::endl;
+    usage(argv[0]);
+    exit(1);
+  }
+
+  std::string dir = make_scratch_directory();
+  printf("# max_node_size %ld min_flush_size %ld value_size %ld\n",
+	 max_node_size, min_flush_size, value_size);
+  {
+    null_backing_store store;
+    swap_space sspace(&store, UINT64_MAX);
+    Logger logger("kv_store.log");
+    betree<uint64_t, std::string> b(&sspace, max_node_size, max_node_size / 4, min_flush_size,
+				    logger);
+    node_benchmark bench(b, sspace, max_node_size, min_flush_size, value_size, random_seed);
+    bench.run_all(warmup, repetitions);
+  }
+  remove_scratch_directory(dir);
+  return 0;
+}
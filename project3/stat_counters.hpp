@@ -0,0 +1,53 @@
+// Event counters for statistics.  Counting has to be cheap enough to
+// leave on everywhere, including the checkpoint and I/O threads, so
+// each thread adds to its own cache line of slots and get() sums all
+// of them.  Threads are given slots round robin; two threads sharing
+// one still count correctly, just with some cache line traffic.
+
+#ifndef STAT_COUNTERS_HPP
+#define STAT_COUNTERS_HPP
+
+#include <cstdint>
+#include <atomic>
+
+#define STAT_COUNTER_SLOTS (16)
+
+inline unsigned stat_counter_slot(void)
+{
+  static std::atomic<unsigned> next_slot(0);
+  thread_local unsigned slot = next_slot++ % STAT_COUNTER_SLOTS;
+  return slot;
+}
+
+template<int N>
+class stat_counters {
+public:
+  stat_counters(void) {
+    reset();
+  }
+
+  void add(int counter, uint64_t n = 1) {
+    slots[stat_counter_slot()].counts[counter].fetch_add(n, std::memory_order_relaxed);
+  }
+
+  uint64_t get(int counter) const {
+    uint64_t total = 0;
+    for (const slot &s : slots)
+      total += s.counts[counter].load(std::memory_order_relaxed);
+    return total;
+  }
+
+  void reset(void) {
+    for (slot &s : slots)
+      for (auto &count : s.counts)
+        count.store(0, std::memory_order_relaxed);
+  }
+
+private:
+  struct alignas(64) slot {
+    std::atomic<uint64_t> counts[N];
+  };
+  slot slots[STAT_COUNTER_SLOTS];
+};
+
+#endif // STAT_COUNTERS_HPP
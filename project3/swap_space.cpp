@@ -1,5 +1,11 @@
 #include "swap_space.hpp"
+#include "compression.hpp"
 #include <fstream>
+#include <deque>
+#include <memory>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 
 //Methods to serialize/deserialize different kinds of objects.
@@ -54,13 +60,27 @@ bool swap_space::cmp_by_last_access(swap_space::object *a, swap_space::object *b
   return a->last_access < b->last_access;
 }
 
+//images are ordered separately, since last_access changes while the
+//object is being reloaded from its image.
+bool swap_space::cmp_by_image_access(swap_space::object *a, swap_space::object *b) {
+  return a->image_access < b->image_access;
+}
+
 swap_space::swap_space(backing_store *bs, uint64_t n) :
   backstore(bs),
   max_in_memory_objects(n),
   objects(),
-  lru_pqueue(cmp_by_last_access)
+  lru_pqueue(cmp_by_last_access),
+  image_lru(cmp_by_image_access)
 {}
 
+//let any checkpoint and garbage collection still in flight finish
+//before tearing down.
+swap_space::~swap_space(void) {
+  checkpointer.drain();
+  collector.drain();
+}
+
 //construct a new object. Called by ss->allocate() via pointer<Referent> construction
 //Does not insert into objects table - that's handled by pointer<Referent>()
 swap_space::object::object(swap_space *sspace, serializable * tgt) {
@@ -71,7 +91,31 @@ swap_space::object::object(swap_space *sspace, serializable * tgt) {
   refcount = 1;
   last_access = sspace->next_access_time++;
   target_is_dirty = true;
+  target_is_unwritten = false;
   pincount = 0;
+  image = NULL;
+  image_access = 0;
+  image_size = 0;
+  image_is_compressed = false;
+  image_is_dirty = false;
+}
+
+//construct the object for a version that exists only on disk.
+swap_space::object::object(uint64_t obj_id, const version_entry &entry) {
+  target = NULL;
+  id = obj_id;
+  version = entry.version;
+  is_leaf = entry.is_leaf;
+  refcount = 1;
+  last_access = UINT64_MAX;
+  target_is_dirty = false;
+  target_is_unwritten = false;
+  pincount = 0;
+  image = NULL;
+  image_access = 0;
+  image_size = 0;
+  image_is_compressed = false;
+  image_is_dirty = false;
 }
 
 //set # of items that can live in ss.
@@ -81,46 +125,99 @@ void swap_space::set_cache_size(uint64_t sz) {
   maybe_evict_something();
 }
 
-//write an object that lives on disk back to disk
-//only triggers a write if the object is "dirty" (target_is_dirty == true)
-void swap_space::write_back(swap_space::object *obj)
+void swap_space::set_evict_on_checkpoint(bool evict) {
+  evict_on_checkpoint = evict;
+}
+
+void swap_space::set_mapped_reads(bool mapped) {
+  mapped_reads = mapped;
+}
+
+swap_space::cache_stats swap_space::get_cache_stats(void) const
 {
-  assert(objects.count(obj->id) > 0);
+  cache_stats stats;
+  stats.hits = counters.get(CACHE_HITS);
+  stats.misses = counters.get(CACHE_MISSES);
+  stats.loads_from_memory = counters.get(LOADS_FROM_MEMORY);
+  stats.loads_from_disk = counters.get(LOADS_FROM_DISK);
+  stats.bytes_loaded_from_disk = counters.get(BYTES_LOADED_FROM_DISK);
+  stats.mapped_reads = counters.get(MAPPED_READS);
+  stats.clean_evictions = counters.get(CLEAN_EVICTIONS);
+  stats.dirty_evictions = counters.get(DIRTY_EVICTIONS);
+  stats.node_writes = counters.get(NODE_WRITES);
+  stats.node_bytes_written = counters.get(NODE_BYTES_WRITTEN);
+  stats.version_map_writes = counters.get(VERSION_MAP_WRITES);
+  stats.version_map_bytes_written = counters.get(VERSION_MAP_BYTES_WRITTEN);
+  return stats;
+}
 
-  debug(std::cout << "Writing back " << obj->id
-	<< " (" << obj->target << ") "
-	<< "with last access time " << obj->last_access << std::endl);
+//set the byte budget of the image cache.
+void swap_space::set_image_cache_size(uint64_t bytes, bool compress) {
+  max_image_bytes = bytes;
+  compress_images = compress;
+  maybe_evict_image();
+}
 
-  // This calls _serialize on all the pointers in this object,
-  // which keeps refcounts right later on when we delete them all.
-  // In the future, we may also use this to implement in-memory
-  // evictions, i.e. where we first "evict" an object by
-  // compressing it and keeping the compressed version in memory.
+//serialize an in-memory object.
+//This calls _serialize on all the pointers in this object, which
+//keeps refcounts right later on when we delete them all, so the
+//caller must delete obj->target afterwards unless keep_references
+//is set.
+std::string swap_space::serialize_target(swap_space::object *obj, bool keep_references)
+{
   serialization_context ctxt(*this);
+  ctxt.keep_references = keep_references;
   std::stringstream sstream;
   serialize(sstream, ctxt, *obj->target);
   obj->is_leaf = ctxt.is_leaf;
+  return sstream.str();
+}
+
+//write a serialized object to the backing store
+void swap_space::write_version(uint64_t id, uint64_t version, const std::string &buffer)
+{
+  backstore->write(id, version, buffer);
+}
 
-  if (obj->target_is_dirty) {
-    std::string buffer = sstream.str();
+//write a serialized object to the backing store as a new version.
+//With a batch, the write is only started; buffer must live until the
+//batch completes.
+void swap_space::write_image(swap_space::object *obj, const std::string &buffer, io_batch *batch)
+{
+  //modification - ss now controls BSID - split into unique id and version.
+  //version increments linearly based uniquely on this version counter.
 
+  uint64_t new_version_id = obj->version+1;
 
-    //modification - ss now controls BSID - split into unique id and version.
-    //version increments linearly based uniquely on this version counter.
+  if (batch)
+    batch->write(obj->id, new_version_id, buffer);
+  else
+    write_version(obj->id, new_version_id, buffer);
+  counters.add(NODE_WRITES);
+  counters.add(NODE_BYTES_WRITTEN, buffer.size());
 
-    uint64_t new_version_id = obj->version+1;
+  retire_version(obj->id, obj->version);
+  obj->version = new_version_id;
+  set_version(obj->id, new_version_id, obj->is_leaf);
+}
 
-    backstore->allocate(obj->id, new_version_id);
-    std::iostream *out = backstore->get(obj->id, new_version_id);
-    out->write(buffer.data(), buffer.length());
-    backstore->put(out);
+//write an object that lives on disk back to disk
+//only triggers a write if the object is "dirty" (target_is_dirty == true)
+//or was reloaded from a dirty image (target_is_unwritten == true)
+void swap_space::write_back(swap_space::object *obj)
+{
+  assert(objects.count(obj->id) > 0);
 
-    //version 0 is the flag that the object exists only in memory.
-    // if (obj->version > 0)
-    //   backstore->deallocate(obj->id, obj->version);
-    obj->version = new_version_id;
-    objects_to_versions[obj->id] = new_version_id;
+  debug(std::cout << "Writing back " << obj->id
+	<< " (" << obj->target << ") "
+	<< "with last access time " << obj->last_access << std::endl);
+
+  std::string buffer = serialize_target(obj);
+
+  if (obj->target_is_dirty || obj->target_is_unwritten) {
+    write_image(obj, buffer);
     obj->target_is_dirty = false;
+    obj->target_is_unwritten = false;
   }
 }
 
@@ -128,6 +225,9 @@ void swap_space::write_back(swap_space::object *obj)
 //attempt to evict an unused object from the swap space
 //objects in swap space are referenced in a priority queue
 //pull objects with low counts first to try and find an object with pincount 0.
+//If the image cache is enabled, the evicted object is serialized
+//(and maybe compressed) into it instead of being written to disk, so
+//reloading it later is just a decode.
 void swap_space::maybe_evict_something(void)
 {
   while (current_in_memory_objects > max_in_memory_objects) {
@@ -141,21 +241,116 @@ void swap_space::maybe_evict_something(void)
       return;
     lru_pqueue.erase(obj);
 
-    write_back(obj);
+    if (obj->target_is_dirty || obj->target_is_unwritten)
+      counters.add(DIRTY_EVICTIONS);
+    else
+      counters.add(CLEAN_EVICTIONS);
+    if (max_image_bytes > 0)
+      stash_image(obj);
+    else
+      write_back(obj);
     
     delete obj->target;
     obj->target = NULL;
     current_in_memory_objects--;
   }
+  maybe_evict_image();
+}
+
+//move an object's serialized image into the image cache.
+//The image inherits the object's dirtiness: it reaches the backing
+//store only when it falls out of the image cache or at a checkpoint.
+void swap_space::stash_image(swap_space::object *obj)
+{
+  assert(obj->image == NULL);
+
+  debug(std::cout << "Stashing " << obj->id
+	<< " (" << obj->target << ") "
+	<< "with last access time " << obj->last_access << std::endl);
+
+  std::string buffer = serialize_target(obj);
+  obj->image_access = next_access_time++;
+  obj->image_size = buffer.size();
+  obj->image_is_compressed = compress_images;
+  obj->image = new std::string(compress_images ? compress_buffer(buffer) : buffer);
+  obj->image_is_dirty = obj->target_is_dirty || obj->target_is_unwritten;
+  obj->target_is_dirty = false;
+  obj->target_is_unwritten = false;
+
+  current_image_bytes += obj->image->size();
+  image_lru.insert(obj);
+}
+
+//return the uncompressed contents of an object's image
+std::string swap_space::image_contents(swap_space::object *obj)
+{
+  assert(obj->image != NULL);
+  if (!obj->image_is_compressed)
+    return *obj->image;
+  std::string buffer;
+  bool ok = decompress_buffer(*obj->image, obj->image_size, buffer);
+  assert(ok);
+  (void)ok;
+  return buffer;
+}
+
+//remove an object's image from the image cache and return its
+//contents.  Called when the object is loaded back into memory, so
+//any unwritten changes carried by the image move back to the object.
+std::string swap_space::take_image(swap_space::object *obj)
+{
+  std::string buffer = image_contents(obj);
+  obj->target_is_unwritten = obj->image_is_dirty;
+  drop_image(obj);
+  return buffer;
+}
+
+//discard an object's image, if it has one
+void swap_space::drop_image(swap_space::object *obj)
+{
+  if (obj->image == NULL)
+    return;
+  image_lru.erase(obj);
+  current_image_bytes -= obj->image->size();
+  delete obj->image;
+  obj->image = NULL;
+  obj->image_is_dirty = false;
+}
+
+//shrink the image cache back under its budget, writing dirty images
+//to the backing store on the way out.
+void swap_space::maybe_evict_image(void)
+{
+  while (current_image_bytes > max_image_bytes && !image_lru.empty()) {
+    object *obj = *image_lru.begin();
+    if (obj->image_is_dirty)
+      write_image(obj, image_contents(obj));
+    drop_image(obj);
+  }
 }
 
+//write back all dirty objects for a checkpoint.
+//Objects are cleaned in place and stay cached, so the checkpoint does
+//not throw away the hottest part of the tree.  set_evict_on_checkpoint
+//restores the old behaviour of evicting them as well.
 void swap_space::write_back_dirty_pages_info_to_disk(void)
 {
-  // Write back all dirty pages and remove them from the queue
+  // The writes of objects that stay cached are all put in flight at
+  // once; images holds their buffers until the batch completes.
+  std::unique_ptr<io_batch> batch(backstore->begin_batch());
+  std::deque<std::string> images;
   object *obj = NULL;
   for (auto it = lru_pqueue.begin(); it != lru_pqueue.end();) {
       obj = *it;
-      if (obj == NULL || !obj->target_is_dirty) {
+      if (obj == NULL || !(obj->target_is_dirty || obj->target_is_unwritten)) {
+          ++it;
+          continue;
+      }
+      if (!evict_on_checkpoint) {
+          images.push_back(serialize_target(obj, true));
+          write_image(obj, images.back(), batch.get());
+          obj->target_is_dirty = false;
+          obj->target_is_unwritten = false;
           ++it;
           continue;
       }
@@ -169,152 +364,347 @@ void swap_space::write_back_dirty_pages_info_to_disk(void)
 
       it = next_it;
   }
+
+  // Images in the image cache may also hold unwritten changes.
+  for (auto it = image_lru.begin(); it != image_lru.end(); ++it) {
+    obj = *it;
+    if (obj->image_is_dirty) {
+      images.push_back(image_contents(obj));
+      write_image(obj, images.back(), batch.get());
+      obj->image_is_dirty = false;
+    }
+  }
+  batch->complete();
 }
 
 
-void swap_space::write_version_map_to_disk(void) {
-  std::string version_map_filename = "version_map.txt";
-  std::string temp_version_map_filename = "tmp_version_map.txt";
-  
-  // Open new temp file
-  std::ofstream temp_version_map_file;
-  temp_version_map_file.open(temp_version_map_filename, std::ofstream::out | std::ofstream::trunc);
+//The version map file is a sequence of records of uint64_ts:
+//  magic kind root next lsn count (id version is_leaf)*count checksum
+//A FULL record replaces everything before it, a DELTA record only
+//updates the ids it lists (version 0 means deleted).  A record torn
+//by a crash fails its checksum and is dropped on load.
+#define VERSION_MAP_MAGIC (0x70616d6e6f697376ULL)
+#define VERSION_MAP_FULL (0)
+#define VERSION_MAP_DELTA (1)
+#define VERSION_MAP_HEADER_WORDS (6)
+#define VERSION_MAP_ENTRY_WORDS (3)
 
-  // Write each log record to the file
-  temp_version_map_file << root_id << std::endl;
-  temp_version_map_file << next_id << std::endl;
-  for (const auto& pair : objects_to_versions) {
-      temp_version_map_file << pair.first << ":" << pair.second << std::endl;
+static uint64_t version_map_checksum(const uint64_t *words, size_t n)
+{
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < n; i++) {
+    h ^= words[i];
+    h *= 1099511628211ULL;
   }
-  temp_version_map_file.close();
+  return h;
+}
 
-  // Rename temp file
-  rename(temp_version_map_filename.c_str(), version_map_filename.c_str());
+static void write_all(int fd, const char *buf, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    assert(n > 0);
+    buf += n;
+    len -= n;
+  }
+}
 
+//record that obj id is now at version (0 if it was deleted)
+void swap_space::set_version(uint64_t id, uint64_t version, bool is_leaf)
+{
+  version_entry entry = { version, is_leaf };
+  if (version == 0)
+    objects_to_versions.erase(id);
+  else
+    objects_to_versions[id] = entry;
+  version_map_changes[id] = entry;
+}
+
+bool swap_space::version_map_needs_compaction(void)
+{
+  return version_map_delta_entries + version_map_changes.size() >= objects_to_versions.size();
+}
+
+void swap_space::write_version_map_to_disk(uint64_t checkpoint_lsn) {
+  bool full = version_map_needs_compaction();
+  write_version_map_to_disk(root_id, next_id, checkpoint_lsn,
+                            full ? objects_to_versions : version_map_changes, full);
+  version_map_delta_entries = full ? 0 : version_map_delta_entries + version_map_changes.size();
+  version_map_changes.clear();
+}
+
+void swap_space::write_version_map_to_disk(uint64_t root, uint64_t next, uint64_t checkpoint_lsn,
+                                           const std::unordered_map<uint64_t, version_entry> &versions,
+                                           bool full) {
+  std::vector<uint64_t> record;
+  record.reserve(VERSION_MAP_HEADER_WORDS + VERSION_MAP_ENTRY_WORDS * versions.size() + 1);
+  record.push_back(VERSION_MAP_MAGIC);
+  record.push_back(full ? VERSION_MAP_FULL : VERSION_MAP_DELTA);
+  record.push_back(root);
+  record.push_back(next);
+  record.push_back(checkpoint_lsn);
+  record.push_back(versions.size());
+  for (const auto& pair : versions) {
+    record.push_back(pair.first);
+    record.push_back(pair.second.version);
+    record.push_back(pair.second.is_leaf);
+  }
+  record.push_back(version_map_checksum(record.data(), record.size()));
+
+  // A full table goes to a temp file that is renamed over the old
+  // map; a delta is appended in place.
+  std::string filename = full ? version_map_filename + ".tmp" : version_map_filename;
+  int flags = O_WRONLY | O_CREAT | (full ? O_TRUNC : O_APPEND);
+  int fd = open(filename.c_str(), flags, 0644);
+  assert(fd >= 0);
+  write_all(fd, (const char *)record.data(), record.size() * sizeof(uint64_t));
+  fsync(fd);
+  close(fd);
+  counters.add(VERSION_MAP_WRITES);
+  counters.add(VERSION_MAP_BYTES_WRITTEN, record.size() * sizeof(uint64_t));
+
+  if (full)
+    rename(filename.c_str(), version_map_filename.c_str());
 }
 
 void swap_space::delete_old_version(void) {
-    for (const auto& entry : objects_to_versions) {
-        uint64_t object_id = entry.first;
-        uint64_t current_version = entry.second;
-
-        // Check for and delete all older versions
-        if (current_version > 1) { // Versions start at 1
-            for (uint64_t old_version = 1; old_version < current_version; ++old_version) {
-                // Debug message
-                debug(std::cout << "Deleting old version: Object ID " << object_id 
-                                << ", Version " << old_version << std::endl);
-
-                // Delete the old version from the backing store
-                if (backstore) {
-                    backstore->deallocate(object_id, old_version);
-                }
-            }
-        }
-    }
+  std::vector<std::pair<uint64_t, uint64_t> > superseded;
+  superseded.swap(superseded_versions);
+  collector.submit(std::bind(&swap_space::delete_versions, this, superseded));
+}
 
+//remember that a version is no longer current.
+//version 0 is the flag that the object exists only in memory.
+void swap_space::retire_version(uint64_t id, uint64_t version)
+{
+  if (version > 0)
+    superseded_versions.push_back(std::make_pair(id, version));
 }
 
+//runs on the collector thread.
+void swap_space::delete_versions(std::vector<std::pair<uint64_t, uint64_t> > versions)
+{
+  for (auto it = versions.begin(); it != versions.end(); ++it) {
+    debug(std::cout << "Deleting old version: Object ID " << it->first
+                    << ", Version " << it->second << std::endl);
+    backstore->deallocate(it->first, it->second);
+  }
+}
 
-int swap_space::rebuildVersionMap(std::string filename, uint64_t& root_id, uint64_t& next) {
-  // Read in file and parse out the data
-  std::ifstream file(filename);
-  if (!file.is_open()) {
-      std::cerr << "Error: Could not open file.\n";
-      assert(false);
+//snapshot all dirty state for a fuzzy checkpoint.
+//Everything that needs writing is serialized here, on the caller's
+//thread, so the tree can keep changing while the background thread
+//does the I/O.  Objects stay in memory and become clean.
+void swap_space::begin_checkpoint(uint64_t checkpoint_lsn, std::function<void(void)> done)
+{
+  assert(!checkpoint_in_progress());
+
+  std::vector<std::pair<uint64_t, uint64_t> > writes;
+  std::unique_lock<std::mutex> lock(pending_writes_lock);
+
+  for (auto it = lru_pqueue.begin(); it != lru_pqueue.end(); ++it) {
+    object *obj = *it;
+    if (obj->target == NULL || !(obj->target_is_dirty || obj->target_is_unwritten))
+      continue;
+    retire_version(obj->id, obj->version);
+    obj->version++;
+    pending_writes[std::make_pair(obj->id, obj->version)] = serialize_target(obj, true);
+    set_version(obj->id, obj->version, obj->is_leaf);
+    writes.push_back(std::make_pair(obj->id, obj->version));
+    obj->target_is_dirty = false;
+    obj->target_is_unwritten = false;
   }
 
-  std::string line;
-  int lineCount = 0;
-  while (std::getline(file, line)) {
-      if(lineCount == 0) {
-        root_id = std::stoull(line);
-      }
-      else if(lineCount == 1) {
-        next = std::stoull(line);
-      }
-      else {
-          size_t pos = line.find(':');
-
-          if (pos != std::string::npos) {
-              std::string key = line.substr(0, pos);
-              std::string value = line.substr(pos + 1);
-              objects_to_versions[std::stoull(key)] = std::stoull(value);
-          } else {
-              std::cerr << "Delimiter ':' not found!" << std::endl;
-              assert(false);
-          }
-      }
-      lineCount++;
+  for (auto it = image_lru.begin(); it != image_lru.end(); ++it) {
+    object *obj = *it;
+    if (!obj->image_is_dirty)
+      continue;
+    retire_version(obj->id, obj->version);
+    obj->version++;
+    set_version(obj->id, obj->version, obj->is_leaf);
+    pending_writes[std::make_pair(obj->id, obj->version)] = image_contents(obj);
+    writes.push_back(std::make_pair(obj->id, obj->version));
+    obj->image_is_dirty = false;
   }
 
-  file.close();
+  lock.unlock();
+
+  // The version map is written from a copy: the whole table when it
+  // is time to compact, otherwise just the changes since last time.
+  bool full = version_map_needs_compaction();
+  std::unordered_map<uint64_t, version_entry> versions;
+  if (full) {
+    versions = objects_to_versions;
+    version_map_delta_entries = 0;
+  } else {
+    versions = version_map_changes;
+    version_map_delta_entries += version_map_changes.size();
+  }
+  version_map_changes.clear();
 
-  return 0;
+  std::vector<std::pair<uint64_t, uint64_t> > superseded;
+  superseded.swap(superseded_versions);
+  checkpointer.submit(std::bind(&swap_space::finish_checkpoint, this,
+                                writes, root_id, next_id, checkpoint_lsn, versions, full,
+                                superseded, done));
 }
 
+//background half of a fuzzy checkpoint.
+void swap_space::finish_checkpoint(std::vector<std::pair<uint64_t, uint64_t> > writes,
+                                   uint64_t root, uint64_t next, uint64_t checkpoint_lsn,
+                                   std::unordered_map<uint64_t, version_entry> versions,
+                                   bool full,
+                                   std::vector<std::pair<uint64_t, uint64_t> > superseded,
+                                   std::function<void(void)> done)
+{
+  // Nothing else erases from pending_writes and std::map nodes do not
+  // move, so the buffers can be read without holding the lock while
+  // the batch is in flight.
+  std::unique_ptr<io_batch> batch(backstore->begin_batch());
+  for (auto it = writes.begin(); it != writes.end(); ++it) {
+    std::unique_lock<std::mutex> lock(pending_writes_lock);
+    const std::string &buffer = pending_writes[*it];
+    lock.unlock();
+    batch->write(it->first, it->second, buffer);
+    counters.add(NODE_WRITES);
+    counters.add(NODE_BYTES_WRITTEN, buffer.size());
+  }
+  batch->complete();
+  {
+    std::unique_lock<std::mutex> lock(pending_writes_lock);
+    for (auto it = writes.begin(); it != writes.end(); ++it)
+      pending_writes.erase(*it);
+  }
 
-int swap_space::rebuildObjectMap(uint64_t next) {
-  // Loop through all keys in map
-  for (const auto& pair : objects_to_versions) {
-    // Make object for the key
-    object *newObj = new object(this, nullptr);
-
-    newObj->id = pair.first;
-    newObj->version = pair.second;
-    newObj->target_is_dirty = false;
-    newObj->refcount = 1;
-    newObj->last_access = UINT64_MAX;
-    newObj->pincount = 0;
-
-    // Make filename
-    std::string filepath = "./tmpdir/" + std::to_string(pair.first) + '_' + std::to_string(pair.second);
-
-    // Open the file
-    std::ifstream inputFile(filepath);
-    if (!inputFile) {
-        std::cerr << "Failed to open the file. id:" << pair.first << " version: " << pair.second << std::endl;
-        assert(false);
-    }
+  write_version_map_to_disk(root, next, checkpoint_lsn, versions, full);
+  done();
+  collector.submit(std::bind(&swap_space::delete_versions, this, superseded));
+}
 
-    std::string line;
-    int lineCount = 0;
-    int pivotCount = -1;
-
-    // Read the file line by line
-    while (std::getline(inputFile, line)) {
-        lineCount++;
-
-        if (lineCount == 2) { 
-            std::istringstream iss(line);
-            std::string word;
-            // Check if line starts with map
-            if (iss >> word && word == "map") {
-              // Get number out after map
-                if (iss >> pivotCount) {} 
-                else {
-                    std::cerr << "Failed to extract the number after 'map'." << std::endl;
-                    assert(false);
-                }
-            }
-            break;
-        }
-    }
+//if obj's current version is still waiting to be written by a
+//checkpoint, copy its image into buffer.
+bool swap_space::find_pending_write(swap_space::object *obj, std::string &buffer)
+{
+  std::unique_lock<std::mutex> lock(pending_writes_lock);
+  auto it = pending_writes.find(std::make_pair(obj->id, obj->version));
+  if (it == pending_writes.end())
+    return false;
+  buffer = it->second;
+  return true;
+}
+
+bool swap_space::is_pending_write(swap_space::object *obj)
+{
+  std::unique_lock<std::mutex> lock(pending_writes_lock);
+  return pending_writes.count(std::make_pair(obj->id, obj->version)) > 0;
+}
+
+bool swap_space::checkpoint_in_progress(void)
+{
+  return checkpointer.is_busy();
+}
+
+void swap_space::wait_for_checkpoint(void)
+{
+  checkpointer.drain();
+}
 
-    inputFile.close();
 
-    // Check if file has pivots
-    if(pivotCount == -1) {
-      std::cerr << "Error: Could not find pivot count for . id:" << pair.first << " version: " << pair.second << "\n";
+//load the version map with a single read and replay its records.
+int swap_space::rebuildVersionMap(std::string filename, uint64_t& root_id, uint64_t& next,
+                                  uint64_t& checkpoint_lsn) {
+  version_map_filename = filename;
+
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+      std::cerr << "Error: Could not open file.\n";
       assert(false);
+  }
+  struct stat st;
+  fstat(fd, &st);
+  std::vector<uint64_t> words(st.st_size / sizeof(uint64_t));
+  size_t nbytes = words.size() * sizeof(uint64_t);
+  size_t got = 0;
+  while (got < nbytes) {
+    ssize_t n = read(fd, (char *)words.data() + got, nbytes - got);
+    if (n <= 0)
+      break;
+    got += n;
+  }
+  close(fd);
+  words.resize(got / sizeof(uint64_t));
+
+  size_t pos = 0;
+  version_map_delta_entries = 0;
+  while (pos + VERSION_MAP_HEADER_WORDS <= words.size()) {
+    const uint64_t *header = &words[pos];
+    if (header[0] != VERSION_MAP_MAGIC)
+      break;
+    uint64_t count = header[5];
+    if (count > (words.size() - pos - VERSION_MAP_HEADER_WORDS) / VERSION_MAP_ENTRY_WORDS)
+      break;
+    size_t len = VERSION_MAP_HEADER_WORDS + VERSION_MAP_ENTRY_WORDS * count;
+    if (pos + len >= words.size() ||
+        words[pos + len] != version_map_checksum(header, len))
+      break;
+
+    if (header[1] == VERSION_MAP_FULL) {
+      objects_to_versions.clear();
+      version_map_delta_entries = 0;
+    } else {
+      version_map_delta_entries += count;
     }
-    // Set isleaf
-    newObj->is_leaf = pivotCount == 0;
+    root_id = header[2];
+    next = header[3];
+    checkpoint_lsn = header[4];
+    for (uint64_t i = 0; i < count; i++) {
+      const uint64_t *entry = header + VERSION_MAP_HEADER_WORDS + VERSION_MAP_ENTRY_WORDS * i;
+      version_entry ve = { entry[1], entry[2] != 0 };
+      if (ve.version == 0)
+        objects_to_versions.erase(entry[0]);
+      else
+        objects_to_versions[entry[0]] = ve;
+    }
+    pos += len + 1;
+  }
+
+  // Cut off a torn record so later deltas are appended after the
+  // last good one.
+  if (pos * sizeof(uint64_t) != (size_t)st.st_size) {
+    debug(std::cout << "Dropping torn version map tail at word " << pos << std::endl);
+    int ok = truncate(filename.c_str(), pos * sizeof(uint64_t));
+    assert(ok == 0);
+    (void)ok;
+  }
+
+  delete_unreferenced_versions();
+  return 0;
+}
 
-    // Set new object in map
-    objects[pair.first] = newObj;
+//delete every stored version the version map does not name.  The
+//list of superseded versions lives only in memory, so versions it
+//held when the process stopped, and any written after the last
+//checkpoint, are found here instead.  Their names can be handed out
+//again (versions restart from the map's), so this runs before the
+//tree writes anything rather than on the collector.
+void swap_space::delete_unreferenced_versions(void)
+{
+  std::vector<std::pair<uint64_t, uint64_t> > stored;
+  std::vector<std::pair<uint64_t, uint64_t> > unreferenced;
+  backstore->list_versions(stored);
+  for (auto it = stored.begin(); it != stored.end(); ++it) {
+    auto entry = objects_to_versions.find(it->first);
+    if (entry == objects_to_versions.end() || entry->second.version != it->second)
+      unreferenced.push_back(*it);
   }
+  delete_versions(unreferenced);
+}
+
 
+//Objects are no longer created here: materialize() creates each one
+//from the version map the first time it is referenced, so startup
+//does not have to touch any node files.
+int swap_space::rebuildObjectMap(uint64_t next) {
   if (next != UINT64_MAX) {
     next_id = next;
   }
@@ -327,6 +717,17 @@ int swap_space::rebuildObjectMap(uint64_t next) {
 
 }
 
+//make sure the object for id exists, creating it from its version
+//map entry if this is its first reference since startup.
+void swap_space::materialize(uint64_t id)
+{
+  if (objects.count(id) > 0)
+    return;
+  auto it = objects_to_versions.find(id);
+  assert(it != objects_to_versions.end());
+  objects[id] = new object(id, it->second);
+}
+
 void swap_space::print_LRU(void) {
   object *obj = NULL;
   std::cout << "PRINTING LRU: " << std::endl;
@@ -71,13 +71,19 @@
 #define SWAP_SPACE_HPP
 
 #include <cstdint>
+#include <cstring>
+#include <algorithm>
 #include <unordered_map>
 #include <map>
 #include <set>
+#include <vector>
 #include <functional>
 #include <sstream>
 #include <cassert>
+#include <mutex>
 #include "backing_store.hpp"
+#include "background_worker.hpp"
+#include "stat_counters.hpp"
 #include "debug.hpp"
 
 class swap_space;
@@ -86,10 +92,14 @@ class serialization_context {
 public:
   serialization_context(swap_space &sspace) :
     ss(sspace),
-    is_leaf(true)
+    is_leaf(true),
+    keep_references(false)
   {}
   swap_space &ss;
   bool is_leaf;
+  // Serialize without handing the object's references over to the
+  // serialized copy, so the object can stay in memory afterwards.
+  bool keep_references;
 };
 
 class serializable {
@@ -168,22 +178,192 @@ template<class X> void deserialize(std::iostream &fs, serialization_context &con
   x._deserialize(fs, context);
 }
 
+// Binary encodings for node images that are read in place from the
+// backing store (see swap_space::read_mapped()).  Values use a
+// self-delimiting encoding; keys are turned into bytes that sort the
+// same way the keys do, so that sorted keys share prefixes.  Types
+// without a specialization are only written in the text format.
+template<class X> struct flat_codec {
+  static const bool supported = false;
+  static void encode(std::string &out, const X &x) { assert(0); }
+  static size_t size(const char *p) { assert(0); return 0; }
+  static X decode(const char *p) { assert(0); return X(); }
+  static void encode_key(std::string &out, const X &x) { assert(0); }
+  static X decode_key(const char *p, size_t len) { assert(0); return X(); }
+};
+
+// Keys are big-endian so that neighbouring keys share leading bytes.
+template<> struct flat_codec<uint64_t> {
+  static const bool supported = true;
+  static void encode(std::string &out, const uint64_t &x) {
+    out.append((const char *)&x, sizeof(x));
+  }
+  static size_t size(const char *p) {
+    return sizeof(uint64_t);
+  }
+  static uint64_t decode(const char *p) {
+    uint64_t x;
+    memcpy(&x, p, sizeof(x));
+    return x;
+  }
+  static void encode_key(std::string &out, const uint64_t &x) {
+    for (int shift = 56; shift >= 0; shift -= 8)
+      out.push_back((char)(x >> shift));
+  }
+  static uint64_t decode_key(const char *p, size_t len) {
+    assert(len == sizeof(uint64_t));
+    uint64_t x = 0;
+    for (size_t i = 0; i < len; i++)
+      x = (x << 8) | (unsigned char)p[i];
+    return x;
+  }
+};
+
+// Values are a 32-bit length followed by the bytes; keys are just the
+// bytes, which std::string compares the same way memcmp does.
+template<> struct flat_codec<std::string> {
+  static const bool supported = true;
+  static void encode(std::string &out, const std::string &x) {
+    uint32_t length = x.size();
+    out.append((const char *)&length, sizeof(length));
+    out.append(x);
+  }
+  static size_t size(const char *p) {
+    uint32_t length;
+    memcpy(&length, p, sizeof(length));
+    return sizeof(length) + length;
+  }
+  static std::string decode(const char *p) {
+    uint32_t length;
+    memcpy(&length, p, sizeof(length));
+    return std::string(p + sizeof(length), length);
+  }
+  static void encode_key(std::string &out, const std::string &x) {
+    out.append(x);
+  }
+  static std::string decode_key(const char *p, size_t len) {
+    return std::string(p, len);
+  }
+};
+
+// LEB128 varints for lengths and timestamps in flat images.
+inline void put_varint(std::string &out, uint64_t x) {
+  while (x >= 0x80) {
+    out.push_back((char)(x | 0x80));
+    x >>= 7;
+  }
+  out.push_back((char)x);
+}
+
+inline uint64_t get_varint(const char *&p) {
+  uint64_t x = 0;
+  for (int shift = 0; ; shift += 7) {
+    unsigned char b = *p++;
+    x |= (uint64_t)(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return x;
+  }
+}
+
 class swap_space {
 public:
   
   uint64_t root_id;
   swap_space(backing_store *bs, uint64_t n);
+  ~swap_space(void);
 
   template<class Referent> class pointer;
 
   void write_back_dirty_pages_info_to_disk(void);
-  void write_version_map_to_disk(void);
+  // checkpoint_lsn is the LSN of the first log record the checkpoint
+  // does not cover; rebuildVersionMap() hands it back on recovery.
+  void write_version_map_to_disk(uint64_t checkpoint_lsn);
+  // Hand every version superseded before the last
+  // write_version_map_to_disk() to the garbage collector thread.
   void delete_old_version(void);
-  int rebuildVersionMap(std::string filename, uint64_t& root_id, uint64_t& next);
+
+  // Fuzzy checkpoints.  begin_checkpoint() serializes every dirty
+  // object and marks it clean (it stays cached).  A background thread
+  // then writes those objects and the version map, calls done, and
+  // queues the versions the checkpoint superseded for garbage
+  // collection.  Only one checkpoint may be in flight at a time.
+  void begin_checkpoint(uint64_t checkpoint_lsn, std::function<void(void)> done);
+  bool checkpoint_in_progress(void);
+  void wait_for_checkpoint(void);
+  int rebuildVersionMap(std::string filename, uint64_t& root_id, uint64_t& next,
+                        uint64_t& checkpoint_lsn);
   int rebuildObjectMap(uint64_t next);
   void print_LRU(void);
   void print_ref_counts(void);
 
+  // Size (in bytes) of the in-memory cache of serialized node images
+  // that sits between the object cache and the backing store.  0
+  // disables it.  See maybe_evict_something().
+  void set_image_cache_size(uint64_t bytes, bool compress);
+
+  // Whether write_back_dirty_pages_info_to_disk() also evicts the
+  // objects it writes.  Off by default; only useful for comparison.
+  void set_evict_on_checkpoint(bool evict);
+
+  // Whether read_mapped() may serve reads from the backing store's
+  // mapped images.  Off by default.
+  void set_mapped_reads(bool mapped);
+
+  // Totals since the swap_space was created.  A load is a miss: the
+  // object was not in memory and came back from the image cache or a
+  // pending checkpoint write ("from memory") or the backing store.
+  // Node writes count serialized bytes, before any compression.
+  struct cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t loads_from_memory;
+    uint64_t loads_from_disk;
+    uint64_t bytes_loaded_from_disk;
+    uint64_t mapped_reads;
+    uint64_t clean_evictions;
+    uint64_t dirty_evictions;
+    uint64_t node_writes;
+    uint64_t node_bytes_written;
+    uint64_t version_map_writes;
+    uint64_t version_map_bytes_written;
+  };
+  cache_stats get_cache_stats(void) const;
+
+  // Read-only access to a clean leaf that is only on disk, without
+  // loading it into the cache: f is called on a view of the leaf's
+  // serialized image, mapped straight from the backing store.
+  // Returns false, without calling f, if the object has to be loaded
+  // the usual way; f can return false to ask for the same.
+  template<class F>
+  bool read_mapped(uint64_t id, F f) {
+    if (!mapped_reads || objects.count(id) == 0)
+      return false;
+    object *obj = objects[id];
+    if (obj->target || obj->image || obj->target_is_unwritten ||
+        !obj->is_leaf || obj->version == 0 || is_pending_write(obj))
+      return false;
+    size_t size;
+    const char *data = backstore->map(obj->id, obj->version, size);
+    if (data == NULL)
+      return false;
+    counters.add(MAPPED_READS);
+    // A compressed image is decoded into a scratch buffer, which
+    // still saves the read and deserializing the node.
+    std::string raw;
+    bool ok;
+    try {
+      if (backstore->decode_image(data, size, raw))
+        ok = f(raw.data(), raw.size());
+      else
+        ok = f(data, size);
+    } catch (...) {
+      backstore->unmap(data, size);
+      throw;
+    }
+    backstore->unmap(data, size);
+    return ok;
+  }
+
   //Given a heap pointer, construct a ss object around it.
   //this is used to register nodes in the ss.
   template<class Referent>
@@ -200,6 +380,7 @@ public:
 
   template<class Referent>
   pointer<Referent> get_root(Referent * temp, uint64_t tgt) {
+    materialize(tgt);
     pointer<Referent> root_pointer = pointer<Referent>(this, tgt);
     return root_pointer;
   }
@@ -329,15 +510,18 @@ public:
         debug(std::cout << "Erasing " << target << " id " << ss->objects[target]->id << " version " << ss->objects[target]->version << std::endl);
         // Load it into memory so we can recursively free stuff
         if (obj->target == NULL) {
-          assert(obj->version > 0);
+          assert(obj->version > 0 || obj->image);
           if (!obj->is_leaf) {
             ss->load<Referent>(target);
           } else {
             debug(std::cout << "Skipping load of leaf " << target << " id " << ss->objects[target]->id << " version " << ss->objects[target]->version << std::endl);
           }
         }
+        ss->drop_image(obj);
+        ss->retire_version(obj->id, obj->version);
         ss->objects.erase(target);
-        ss->objects_to_versions.erase(target);
+        if (obj->version > 0)
+          ss->set_version(target, 0, false);
         ss->lru_pqueue.erase(obj);
         if (obj->target){
           delete obj->target;
@@ -412,7 +596,8 @@ public:
       assert(target > 0);
       assert(context.ss.objects.count(target) > 0);
       fs << target << " ";
-      target = 0;
+      if (!context.keep_references)
+        target = 0;
       assert(fs.good());
       context.is_leaf = false;
     }
@@ -422,7 +607,7 @@ public:
       ss = &context.ss;
       fs >> target;
       assert(fs.good());
-      assert(context.ss.objects.count(target) > 0);
+      context.ss.materialize(target);
       // We just created a new reference to this object and
       // invalidated the on-disk reference, so the total refcount
       // stays the same.
@@ -465,10 +650,17 @@ private:
   uint64_t next_id = 1;
   uint64_t next_access_time = 0;
   
+  // What the version map records about each object on disk.
+  struct version_entry {
+    uint64_t version;
+    bool is_leaf;
+  };
+
   class object {
   public:
     
     object(swap_space *sspace, serializable * tgt);
+    object(uint64_t id, const version_entry &entry);
     
     serializable * target;
     uint64_t id;
@@ -477,10 +669,25 @@ private:
     uint64_t refcount;
     uint64_t last_access;
     bool target_is_dirty;
+    // target was reloaded from a dirty image, so it has changes that
+    // never reached the backing store.  Unlike target_is_dirty, this
+    // does not make the object look dirty to the betree, which may
+    // still be buffering messages for it.
+    bool target_is_unwritten;
     uint64_t pincount;
+
+    // Serialized copy of target kept in the image cache after target
+    // has been evicted.  A dirty image has not been written to the
+    // backing store yet.
+    std::string *image;
+    uint64_t image_access;
+    uint64_t image_size;
+    bool image_is_compressed;
+    bool image_is_dirty;
   };
 
   static bool cmp_by_last_access(object *a, object *b);
+  static bool cmp_by_image_access(object *a, object *b);
 
 
   //ss load - if the object is not in memory (target != null)
@@ -488,14 +695,27 @@ private:
   template<class Referent>
   void load(uint64_t tgt) {
     assert(objects.count(tgt) > 0);
-    if (objects[tgt]->target == NULL) {
+    if (objects[tgt]->target != NULL) {
+      counters.add(CACHE_HITS);
+    } else {
+      counters.add(CACHE_MISSES);
       object *obj = objects[tgt];
-      debug(std::cout << "Loading " << obj->id << " version " << obj->version << std::endl);
-      std::iostream *in = backstore->get(obj->id, obj->version);
       Referent *r = new Referent();
       serialization_context ctxt(*this);
-      deserialize(*in, ctxt, *r);
-      backstore->put(in);
+      std::string buffer;
+      if (obj->image || find_pending_write(obj, buffer)) {
+        debug(std::cout << "Loading " << obj->id << " from memory" << std::endl);
+        if (obj->image)
+          buffer = take_image(obj);
+        counters.add(LOADS_FROM_MEMORY);
+      } else {
+        debug(std::cout << "Loading " << obj->id << " version " << obj->version << std::endl);
+        backstore->read(obj->id, obj->version, buffer);
+        counters.add(LOADS_FROM_DISK);
+        counters.add(BYTES_LOADED_FROM_DISK, buffer.size());
+      }
+      std::stringstream in(buffer);
+      deserialize(in, ctxt, *r);
       obj->target = r;
       current_in_memory_objects++;
     }
@@ -503,18 +723,96 @@ private:
 
   void set_cache_size(uint64_t sz);
   
+  std::string serialize_target(object *obj, bool keep_references = false);
+  void write_version(uint64_t id, uint64_t version, const std::string &buffer);
+  void write_image(object *obj, const std::string &buffer, io_batch *batch = NULL);
+  void materialize(uint64_t id);
+  void set_version(uint64_t id, uint64_t version, bool is_leaf);
+  bool version_map_needs_compaction(void);
+  void write_version_map_to_disk(uint64_t root, uint64_t next, uint64_t checkpoint_lsn,
+                                 const std::unordered_map<uint64_t, version_entry> &versions,
+                                 bool full);
+  void retire_version(uint64_t id, uint64_t version);
+  void delete_versions(std::vector<std::pair<uint64_t, uint64_t> > versions);
+  void delete_unreferenced_versions(void);
+  bool find_pending_write(object *obj, std::string &buffer);
+  bool is_pending_write(object *obj);
+  void finish_checkpoint(std::vector<std::pair<uint64_t, uint64_t> > writes,
+                         uint64_t root, uint64_t next, uint64_t checkpoint_lsn,
+                         std::unordered_map<uint64_t, version_entry> versions,
+                         bool full,
+                         std::vector<std::pair<uint64_t, uint64_t> > superseded,
+                         std::function<void(void)> done);
   void write_back(object *obj);
   void maybe_evict_something(void);
+
+  void stash_image(object *obj);
+  std::string take_image(object *obj);
+  std::string image_contents(object *obj);
+  void drop_image(object *obj);
+  void maybe_evict_image(void);
   
   uint64_t max_in_memory_objects;
   uint64_t current_in_memory_objects = 0;
 
+  uint64_t max_image_bytes = 0;
+  uint64_t current_image_bytes = 0;
+  bool compress_images = false;
+  bool evict_on_checkpoint = false;
+  bool mapped_reads = false;
+
+  enum {
+    CACHE_HITS,
+    CACHE_MISSES,
+    LOADS_FROM_MEMORY,
+    LOADS_FROM_DISK,
+    BYTES_LOADED_FROM_DISK,
+    MAPPED_READS,
+    CLEAN_EVICTIONS,
+    DIRTY_EVICTIONS,
+    NODE_WRITES,
+    NODE_BYTES_WRITTEN,
+    VERSION_MAP_WRITES,
+    VERSION_MAP_BYTES_WRITTEN,
+    NUM_CACHE_COUNTERS
+  };
+  // Bumped by the checkpointer thread as well.
+  stat_counters<NUM_CACHE_COUNTERS> counters;
 
   //structs used in ss
   //objects is a map from targets->objects (target == obj->id)
   
-  std::unordered_map<uint64_t, uint64_t> objects_to_versions;
+  // Every object with a version on disk.  After a restart, objects
+  // are only added to the objects table (see materialize()) once
+  // something refers to them.
+  std::unordered_map<uint64_t, version_entry> objects_to_versions;
+
+  // The version map on disk is a full table followed by one delta
+  // record per checkpoint (see write_version_map_to_disk()).
+  // version_map_changes holds the entries for the next delta, with
+  // version 0 for deleted objects.  Once the deltas add up to more
+  // entries than the table, the next checkpoint compacts them.
+  std::string version_map_filename = "version_map.bin";
+  std::unordered_map<uint64_t, version_entry> version_map_changes;
+  uint64_t version_map_delta_entries = 0;
   std::set<object *, bool (*)(object *, object *)> lru_pqueue;
+  std::set<object *, bool (*)(object *, object *)> image_lru;
+
+  // Images serialized by begin_checkpoint() that the background
+  // thread has not written yet, keyed by (id, version).  Loads of
+  // those versions are served from here.
+  std::map<std::pair<uint64_t, uint64_t>, std::string> pending_writes;
+  std::mutex pending_writes_lock;
+  background_worker checkpointer;
+
+  // (id, version) pairs replaced by a newer version, or belonging to
+  // a deleted object, since the last checkpoint.  The version map on
+  // disk may still name them, so they are only deleted, by collector,
+  // once the next version map has been written.  Any still listed
+  // when the process stops are found on restart by
+  // delete_unreferenced_versions().
+  std::vector<std::pair<uint64_t, uint64_t> > superseded_versions;
+  background_worker collector;
 public:
   std::unordered_map<uint64_t, object *> objects;
 };
@@ -11,23 +11,41 @@
 
 #include <string.h>
 #include <sys/types.h>
-#include <sys/time.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include "betree.hpp"
 #include "logger.hpp"
+#include "key_generator.hpp"
+#include "latency_histogram.hpp"
+#include <atomic>
+#include <mutex>
+#include <thread>
 
+// Timers count microseconds on the monotonic clock, so they are not
+// thrown off by changes to the wall clock.
 void timer_start(uint64_t &timer)
 {
-  struct timeval t;
-  assert(!gettimeofday(&t, NULL));
-  timer -= 1000000*t.tv_sec + t.tv_usec;
+  timer -= monotonic_ns() / 1000;
 }
 
 void timer_stop(uint64_t &timer)
 {
-  struct timeval t;
-  assert(!gettimeofday(&t, NULL));
-  timer += 1000000*t.tv_sec + t.tv_usec;
+  timer += monotonic_ns() / 1000;
+}
+
+// p50 p90 p99 p99.9 max, in microseconds
+void print_percentiles(const latency_histogram &h)
+{
+  printf(" %.2f %.2f %.2f %.2f %.2f", h.percentile(50)/1000.0, h.percentile(90)/1000.0,
+	 h.percentile(99)/1000.0, h.percentile(99.9)/1000.0, h.max()/1000.0);
+}
+
+// # latency <operation>: count p50 p90 p99 p99.9 max
+void print_latency(const char *operation, const latency_histogram &h)
+{
+  printf("# latency %s: %ld", operation, h.count());
+  print_percentiles(h);
+  printf("\n");
 }
 
 int next_command(FILE *input, int *op, uint64_t *arg)
@@ -91,8 +109,12 @@ void do_scan(typename betree<Key, Value>::iterator &betit,
 #define DEFAULT_TEST_MAX_NODE_SIZE (1ULL<<6)
 #define DEFAULT_TEST_MIN_FLUSH_SIZE (DEFAULT_TEST_MAX_NODE_SIZE / 4)
 #define DEFAULT_TEST_CACHE_SIZE (4)
+#define DEFAULT_TEST_CHECKPOINT_GRANULARITY (1000)
 #define DEFAULT_TEST_NDISTINCT_KEYS (1ULL << 10)
 #define DEFAULT_TEST_NOPS (1ULL << 12)
+#define DEFAULT_TEST_VALUE_SIZE (100)
+#define DEFAULT_TEST_MAX_SCAN_LENGTH (100)
+#define DEFAULT_TEST_THREAD_COUNTS "1,2,4,8"
 
 void usage(char *name)
 {
@@ -103,28 +125,65 @@ void usage(char *name)
     << "Options are" << std::endl
     << "  Required:"   << std::endl
     << "    -d <backing_store_directory>                    [ default: none, parameter is required ]"           << std::endl
+    << "                                  (unless -B is given without -V)"                                      << std::endl
     << "    -m  <mode>  (test or benchmark-<mode>)          [ default: none, parameter required ]"              << std::endl
+    << "        test-value-log (test with -v byte values and value log GC, needs -V)"                          << std::endl
     << "        benchmark modes:"                                                                               << std::endl
     << "          upserts    "                                                                                  << std::endl
     << "          queries    "                                                                                  << std::endl
+    << "          ycsb       (YCSB core workload, see -w)"                                                      << std::endl
+    << "          threads    (YCSB workload from several threads, see -w and -T)"                               << std::endl
+    << "          amplification (disk bytes per user byte: -t upserts of -v byte values, then -t queries)"  << std::endl
+    << "          full-scans   (-t scans of the whole tree)"                                                  << std::endl
+    << "          range-scans  (-t scans of -S records from random keys)"                                     << std::endl
+    << "          mixed-scans  (-t operations, half range scans and half upserts)"                            << std::endl
     << "  Betree tuning parameters:" << std::endl
     << "    -N <max_node_size>            (in elements)     [ default: " << DEFAULT_TEST_MAX_NODE_SIZE  << " ]" << std::endl
     << "    -f <min_flush_size>           (in elements)     [ default: " << DEFAULT_TEST_MIN_FLUSH_SIZE << " ]" << std::endl
     << "    -C <max_cache_size>           (in betree nodes) [ default: " << DEFAULT_TEST_CACHE_SIZE     << " ]" << std::endl
+    << "    -c <checkpoint_granularity>   (in operations)   [ default: " << DEFAULT_TEST_CHECKPOINT_GRANULARITY << " ]" << std::endl
+    << "    -Z <image_cache_size>         (in bytes)        [ default: 0 (disabled) ]"                          << std::endl
+    << "    -z                            (compress images) [ default: off ]"                                   << std::endl
+    << "    -F                            (fuzzy checkpoints) [ default: off ]"                                 << std::endl
+    << "    -M                            (mapped leaf reads) [ default: off ]"                                 << std::endl
+    << "    -D                            (O_DIRECT node I/O) [ default: off ]"                                 << std::endl
+    << "    -U                            (thread pool instead of io_uring) [ default: off ]"                   << std::endl
+    << "    -L                            (compress nodes on disk) [ default: off ]"                            << std::endl
+    << "    -V <value_log_threshold>      (in bytes)        [ default: 0 (no value log) ]"                      << std::endl
+    << "    -G <value_log_segment_size>   (in bytes)        [ default: " << DEFAULT_VALUE_LOG_SEGMENT_SIZE << " ]" << std::endl
+    << "  Backing store options" << std::endl
+    << "    -B                            (keep nodes in memory, needs an empty version map) [ default: off ]"  << std::endl
+    << "    -l <latency>                  (in microseconds per node read or write, with -B) [ default: 0 ]"    << std::endl
+    << "    -b <bandwidth>                (in MB/s, with -B) [ default: 0 (unlimited) ]"                        << std::endl
     << "  Options for both tests and benchmarks" << std::endl
     << "    -k <number_of_distinct_keys>                    [ default: " << DEFAULT_TEST_NDISTINCT_KEYS << " ]" << std::endl
     << "    -t <number_of_operations>                       [ default: " << DEFAULT_TEST_NOPS           << " ]" << std::endl
     << "    -s <random_seed>                                [ default: random ]"                                << std::endl
+    << "  Benchmark options" << std::endl
+    << "    -K <key_distribution>                           [ default: uniform, or YCSB's for ycsb ]"         << std::endl
+    << "        uniform"                                                                                        << std::endl
+    << "        zipfian[:theta]              (theta in (0, 1), default " << DEFAULT_ZIPFIAN_THETA << ")"        << std::endl
+    << "        scrambled[:theta]            (zipfian with the popular keys scattered)"                        << std::endl
+    << "        latest[:theta]               (zipfian favouring the newest keys)"                               << std::endl
+    << "        hotspot[:hot_keys[:hot_ops]] (fractions, default " << DEFAULT_HOTSPOT_KEYS << ":" << DEFAULT_HOTSPOT_OPS << ")" << std::endl
+    << "  YCSB and scan benchmark options (-k is the number of records loaded)" << std::endl
+    << "    -w <workload>                 (a to f)          [ default: none, required for ycsb ]"             << std::endl
+    << "    -v <value_size>               (in bytes)        [ default: " << DEFAULT_TEST_VALUE_SIZE     << " ]" << std::endl
+    << "    -S <max_scan_length>          (in records)      [ default: " << DEFAULT_TEST_MAX_SCAN_LENGTH << " ]" << std::endl
+    << "                                  (the exact length for range-scans and mixed-scans)"                 << std::endl
+    << "    -T <thread_counts>            (comma separated) [ default: " << DEFAULT_TEST_THREAD_COUNTS << " ]"  << std::endl
     << "  Test scripting options" << std::endl
     << "    -o <output_script>                              [ default: no output ]"                             << std::endl
     << "    -i <script_file>                                [ default: none ]"                                  << std::endl;
 }
 
+// Inserted values are the key followed by padding.
 int test(betree<uint64_t, std::string> &b,
 	 uint64_t nops,
 	 uint64_t number_of_distinct_keys,
 	 FILE *script_input,
-	 FILE *script_output)
+	 FILE *script_output,
+	 const std::string &padding = "")
 {
   std::map<uint64_t, std::string> reference;
 
@@ -147,8 +206,8 @@ int test(betree<uint64_t, std::string> &b,
     case 0: // insert
       if (script_output)
 	fprintf(script_output, "Inserting %lu\n", t);
-      b.insert(t, std::to_string(t) + ":");
-      reference[t] = std::to_string(t) + ":";
+      b.insert(t, std::to_string(t) + ":" + padding);
+      reference[t] = std::to_string(t) + ":" + padding;
       break;
     case 1: // update
       if (script_output)
@@ -218,77 +277,580 @@ int test(betree<uint64_t, std::string> &b,
 
 void benchmark_upserts(betree<uint64_t, std::string> &b,
 		       uint64_t nops,
-		       uint64_t number_of_distinct_keys,
+		       key_generator &keys,
 		       uint64_t random_seed)
 {
+  fast_rng rng(random_seed);
   uint64_t overall_timer = 0;
+  latency_histogram overall, interval;
   for (uint64_t j = 0; j < 100; j++) {
     uint64_t timer = 0;
+    interval.reset();
     timer_start(timer);
     for (uint64_t i = 0; i < nops / 100; i++) {
-      uint64_t t = rand() % number_of_distinct_keys;
+      uint64_t t = keys.next(rng);
+      uint64_t start = monotonic_ns();
       b.update(t, std::to_string(t) + ":");
+      interval.record(monotonic_ns() - start);
     }
     timer_stop(timer);
-    printf("%ld %ld %ld\n", j, nops/100, timer);
+    printf("%ld %ld %ld", j, nops/100, timer);
+    print_percentiles(interval);
+    printf("\n");
     overall_timer += timer;
+    overall.merge(interval);
   }
 
   double throughput = (1.0*nops*1000000)/overall_timer;
+  print_latency("update", overall);
   printf("# overall: %ld %ld %f\n", 100*(nops/100), overall_timer, throughput);
 }
 
 void benchmark_queries(betree<uint64_t, std::string> &b,
 		       uint64_t nops,
-		       uint64_t number_of_distinct_keys,
+		       key_generator &keys,
 		       uint64_t random_seed)
 {
   
   // Pre-load the tree with data
-  srand(random_seed);
+  fast_rng load_rng(random_seed);
   for (uint64_t i = 0; i < nops; i++) {
-    uint64_t t = rand() % number_of_distinct_keys;
+    uint64_t t = keys.next(load_rng);
     b.update(t, std::to_string(t) + ":");
   }
 
 	// Now go back and query it
-  srand(random_seed);
+  fast_rng rng(random_seed);
   uint64_t overall_timer = 0;
+  latency_histogram latency;
 	timer_start(overall_timer);
   for (uint64_t i = 0; i < nops; i++) {
-    uint64_t t = rand() % number_of_distinct_keys;
+    uint64_t t = keys.next(rng);
+    uint64_t start = monotonic_ns();
     b.query(t);
+    latency.record(monotonic_ns() - start);
   }
 	timer_stop(overall_timer);
 
   double throughput = (1.0*nops*1000000)/overall_timer;
+  print_latency("query", latency);
   printf("# overall: %ld %ld, %f\n", nops, overall_timer, throughput);
 
 }
 
+// The YCSB core workloads, as percentages of each operation type,
+// and the key distribution YCSB uses for them by default.  Updates
+// overwrite the whole record, scans start at a random key and read up
+// to max_scan_length records, and inserts add new keys after the
+// loaded ones.
+struct ycsb_workload {
+  char name;
+  const char *distribution;
+  unsigned read;
+  unsigned update;
+  unsigned insert;
+  unsigned scan;
+  unsigned read_modify_write;
+};
+
+static const ycsb_workload ycsb_workloads[] = {
+  { 'a', "scrambled",  50, 50, 0,  0,  0 },  // update heavy
+  { 'b', "scrambled",  95,  5, 0,  0,  0 },  // read mostly
+  { 'c', "scrambled", 100,  0, 0,  0,  0 },  // read only
+  { 'd', "latest",     95,  0, 5,  0,  0 },  // read latest
+  { 'e', "scrambled",   0,  0, 5, 95,  0 },  // short ranges
+  { 'f', "scrambled",  50,  0, 0,  0, 50 },  // read-modify-write
+};
+
+const ycsb_workload * find_ycsb_workload(char name)
+{
+  for (const ycsb_workload &w : ycsb_workloads)
+    if (w.name == tolower(name))
+      return &w;
+  return NULL;
+}
+
+// Values are slices of a random string, so they are neither all alike
+// nor expensive to make.
+class value_generator {
+public:
+  value_generator(uint64_t value_size, fast_rng &rng) :
+    value_size(value_size),
+    pool(2 * value_size, '\0')
+  {
+    for (char &c : pool)
+      c = 'a' + rng.uniform(26);
+  }
+
+  std::string next(fast_rng &rng) {
+    return pool.substr(rng.uniform(value_size + 1), value_size);
+  }
+
+private:
+  uint64_t value_size;
+  std::string pool;
+};
+
+static const char *ycsb_operations[] = { "read", "update", "insert", "scan", "read-modify-write" };
+
+// One client of a YCSB run, with its own random stream and its own
+// copy of the key distribution, so that threads share neither.
+struct ycsb_client {
+  ycsb_client(key_generator *keys, uint64_t value_size, uint64_t seed) :
+    rng(seed),
+    values(value_size, rng),
+    keys(keys),
+    scanned(0),
+    ops(0),
+    timer(0)
+  {}
+
+  fast_rng rng;
+  value_generator values;
+  std::unique_ptr<key_generator> keys;
+  latency_histogram latency[5];
+  uint64_t scanned;
+  uint64_t ops;
+  uint64_t timer;
+};
+
+// Run one operation of workload and return its index in
+// ycsb_operations.  nrecords counts the records inserted so far by all
+// clients.  The tree is only touched while holding tree_lock.
+int ycsb_operation(betree<uint64_t, std::string> &b,
+		   const ycsb_workload &workload,
+		   ycsb_client &client,
+		   std::atomic<uint64_t> &nrecords,
+		   uint64_t max_scan_length,
+		   std::mutex &tree_lock)
+{
+  uint64_t n = nrecords.load();
+  if (n > client.keys->size())
+    client.keys->grow(n);
+  unsigned p = client.rng.uniform(100);
+  uint64_t t = client.keys->next(client.rng);
+
+  if (p < workload.read) {
+    std::lock_guard<std::mutex> guard(tree_lock);
+    try {
+      b.query(t);
+    } catch (std::out_of_range & e) {}
+    return 0;
+  } else if ((p -= workload.read) < workload.update) {
+    std::string v = client.values.next(client.rng);
+    std::lock_guard<std::mutex> guard(tree_lock);
+    b.insert(t, v);
+    return 1;
+  } else if ((p -= workload.update) < workload.insert) {
+    std::string v = client.values.next(client.rng);
+    std::lock_guard<std::mutex> guard(tree_lock);
+    b.insert(nrecords++, v);
+    return 2;
+  } else if ((p -= workload.insert) < workload.scan) {
+    uint64_t length = 1 + client.rng.uniform(max_scan_length);
+    std::lock_guard<std::mutex> guard(tree_lock);
+    for (auto it = b.lower_bound(t); it != b.end() && length > 0; ++it, --length)
+      client.scanned++;
+    return 3;
+  } else {
+    std::string v = client.values.next(client.rng);
+    std::lock_guard<std::mutex> guard(tree_lock);
+    try {
+      b.query(t);
+    } catch (std::out_of_range & e) {}
+    b.insert(t, v);
+    return 4;
+  }
+}
+
+void ycsb_load(betree<uint64_t, std::string> &b,
+	       uint64_t record_count,
+	       uint64_t value_size,
+	       uint64_t random_seed)
+{
+  fast_rng rng(random_seed);
+  value_generator values(value_size, rng);
+  uint64_t load_timer = 0;
+  timer_start(load_timer);
+  for (uint64_t i = 0; i < record_count; i++)
+    b.insert(i, values.next(rng));
+  timer_stop(load_timer);
+  printf("# load: %ld %ld %f\n", record_count, load_timer,
+	 (1.0*record_count*1000000)/load_timer);
+}
+
+void benchmark_ycsb(betree<uint64_t, std::string> &b,
+		    const ycsb_workload &workload,
+		    uint64_t nops,
+		    const char *key_distribution,
+		    uint64_t record_count,
+		    uint64_t value_size,
+		    uint64_t max_scan_length,
+		    uint64_t random_seed)
+{
+  ycsb_load(b, record_count, value_size, random_seed);
+
+  // Run phase, in 100 intervals like benchmark_upserts
+  ycsb_client client(key_generator::create(key_distribution, record_count),
+		     value_size, random_seed + 1);
+  std::atomic<uint64_t> nrecords(record_count);
+  std::mutex tree_lock;
+  latency_histogram interval;
+  uint64_t overall_timer = 0;
+  for (uint64_t j = 0; j < 100; j++) {
+    uint64_t timer = 0;
+    interval.reset();
+    timer_start(timer);
+    for (uint64_t i = 0; i < nops / 100; i++) {
+      uint64_t start = monotonic_ns();
+      int op = ycsb_operation(b, workload, client, nrecords, max_scan_length, tree_lock);
+      uint64_t elapsed = monotonic_ns() - start;
+      client.latency[op].record(elapsed);
+      interval.record(elapsed);
+    }
+    timer_stop(timer);
+    printf("%ld %ld %ld", j, nops/100, timer);
+    print_percentiles(interval);
+    printf("\n");
+    overall_timer += timer;
+  }
+
+  for (int op = 0; op < 5; op++)
+    if (client.latency[op].count())
+      print_latency(ycsb_operations[op], client.latency[op]);
+  if (client.latency[3].count())
+    printf("# scanned: %ld\n", client.scanned);
+  printf("# overall: %ld %ld %f\n", 100*(nops/100), overall_timer,
+	 (1.0*100*(nops/100)*1000000)/overall_timer);
+}
+
+// Run the workload from each number of client threads in
+// thread_counts in turn, nops operations in all each time.  The tree
+// is not thread-safe, so clients take turns at it under one lock; the
+// scaling measured is that of everything around the tree (key and
+// value generation, checkpoint and swap_space background threads).
+// Prints a line per client,
+//   <threads> <client> <ops> <time> <ops/s>
+// then the latencies of all clients and
+//   # threads <threads>: <ops> <time> <ops/s>
+void benchmark_threads(betree<uint64_t, std::string> &b,
+		       const ycsb_workload &workload,
+		       uint64_t nops,
+		       const char *key_distribution,
+		       uint64_t record_count,
+		       uint64_t value_size,
+		       uint64_t max_scan_length,
+		       uint64_t random_seed,
+		       const std::vector<unsigned> &thread_counts)
+{
+  ycsb_load(b, record_count, value_size, random_seed);
+
+  std::atomic<uint64_t> nrecords(record_count);
+  std::mutex tree_lock;
+  for (unsigned nthreads : thread_counts) {
+    std::vector<std::unique_ptr<ycsb_client> > clients;
+    for (unsigned i = 0; i < nthreads; i++)
+      clients.push_back(std::unique_ptr<ycsb_client>(
+	new ycsb_client(key_generator::create(key_distribution, nrecords.load()),
+			value_size, random_seed + 1000 * nthreads + i)));
+
+    std::vector<std::thread> threads;
+    uint64_t timer = 0;
+    timer_start(timer);
+    for (unsigned i = 0; i < nthreads; i++) {
+      ycsb_client *client = clients[i].get();
+      uint64_t ops = nops / nthreads + (i < nops % nthreads);
+      threads.push_back(std::thread([&b, &workload, &nrecords, &tree_lock,
+				     client, ops, max_scan_length] {
+	timer_start(client->timer);
+	for (uint64_t j = 0; j < ops; j++) {
+	  uint64_t start = monotonic_ns();
+	  int op = ycsb_operation(b, workload, *client, nrecords, max_scan_length, tree_lock);
+	  client->latency[op].record(monotonic_ns() - start);
+	}
+	timer_stop(client->timer);
+	client->ops = ops;
+      }));
+    }
+    for (auto &t : threads)
+      t.join();
+    timer_stop(timer);
+
+    latency_histogram latency[5];
+    for (unsigned i = 0; i < nthreads; i++) {
+      const ycsb_client &client = *clients[i];
+      printf("%u %u %ld %ld %f\n", nthreads, i, client.ops, client.timer,
+	     (1.0*client.ops*1000000)/client.timer);
+      for (int op = 0; op < 5; op++)
+	latency[op].merge(client.latency[op]);
+    }
+    for (int op = 0; op < 5; op++)
+      if (latency[op].count())
+	print_latency(ycsb_operations[op], latency[op]);
+    printf("# threads %u: %ld %ld %f\n", nthreads, nops, timer,
+	   (1.0*nops*1000000)/timer);
+  }
+}
+
+// Bytes the tree moved to and from disk for each byte the user asked
+// for.  nops upserts of value_size byte values are followed by a
+// checkpoint, so everything they wrote is on disk, then nops queries
+// of the same keys.  A user byte is a key or value byte.  Physical
+// writes are node files as stored (after -L), the version map, the
+// WAL and the value log; physical reads are node files read or
+// mapped, and the value log.  Prints
+//   # write: <user> <nodes> <version_map> <wal> <value_log> <amplification>
+//   # read: <user> <nodes> <mapped> <value_log> <amplification>
+//   # amplification <max_node_size> <min_flush_size>: <write> <read>
+void benchmark_amplification(betree<uint64_t, std::string> &b,
+			     swap_space &sspace,
+			     backing_store &store,
+			     Logger &logger,
+			     value_log *vlog,
+			     uint64_t nops,
+			     key_generator &keys,
+			     uint64_t value_size,
+			     uint64_t random_seed,
+			     uint64_t max_node_size,
+			     uint64_t min_flush_size)
+{
+  swap_space::cache_stats cache_before = sspace.get_cache_stats();
+  backing_store::io_stats io_before = store.get_io_stats();
+  Logger::Stats wal_before = logger.get_stats();
+  value_log::stats vlog_before = vlog ? vlog->get_stats() : value_log::stats();
+
+  fast_rng rng(random_seed);
+  value_generator values(value_size, rng);
+  uint64_t user_written = 0;
+  uint64_t timer = 0;
+  timer_start(timer);
+  for (uint64_t i = 0; i < nops; i++) {
+    uint64_t t = keys.next(rng);
+    std::string value = values.next(rng);
+    b.insert(t, value);
+    user_written += sizeof(t) + value.size();
+  }
+  sspace.wait_for_checkpoint();
+  b.checkpoint();
+  sspace.wait_for_checkpoint();
+  timer_stop(timer);
+  printf("# upserts: %ld %ld %f\n", nops, timer, (1.0*nops*1000000)/timer);
+
+  swap_space::cache_stats cache_written = sspace.get_cache_stats();
+  backing_store::io_stats io_written = store.get_io_stats();
+  Logger::Stats wal_after = logger.get_stats();
+  value_log::stats vlog_written = vlog ? vlog->get_stats() : value_log::stats();
+  uint64_t node_bytes = io_written.bytes_written - io_before.bytes_written;
+  uint64_t version_map_bytes =
+    cache_written.version_map_bytes_written - cache_before.version_map_bytes_written;
+  uint64_t wal_bytes = wal_after.bytes_written - wal_before.bytes_written;
+  uint64_t vlog_bytes = vlog_written.bytes_written - vlog_before.bytes_written;
+  uint64_t physical_written = node_bytes + version_map_bytes + wal_bytes + vlog_bytes;
+  double write_amplification = user_written ? (1.0*physical_written)/user_written : 0;
+  printf("# write: %ld %ld %ld %ld %ld %f\n", user_written, node_bytes, version_map_bytes,
+	 wal_bytes, vlog_bytes, write_amplification);
+
+  // The same keys again, so every query finds its key
+  fast_rng query_rng(random_seed);
+  value_generator query_values(value_size, query_rng);
+  uint64_t user_read = 0;
+  timer = 0;
+  timer_start(timer);
+  for (uint64_t i = 0; i < nops; i++) {
+    uint64_t t = keys.next(query_rng);
+    query_values.next(query_rng);
+    user_read += sizeof(t) + b.query(t).size();
+  }
+  timer_stop(timer);
+  printf("# queries: %ld %ld %f\n", nops, timer, (1.0*nops*1000000)/timer);
+
+  backing_store::io_stats io_read = store.get_io_stats();
+  value_log::stats vlog_read = vlog ? vlog->get_stats() : value_log::stats();
+  uint64_t node_read = io_read.bytes_read - io_written.bytes_read;
+  uint64_t mapped = io_read.bytes_mapped - io_written.bytes_mapped;
+  uint64_t vlog_read_bytes = vlog_read.bytes_read - vlog_written.bytes_read;
+  double read_amplification =
+    user_read ? (1.0*(node_read + mapped + vlog_read_bytes))/user_read : 0;
+  printf("# read: %ld %ld %ld %ld %f\n", user_read, node_read, mapped, vlog_read_bytes,
+	 read_amplification);
+
+  printf("# amplification %ld %ld: %f %f\n", max_node_size, min_flush_size,
+	 write_amplification, read_amplification);
+}
+
+// Node accesses so far, whether served from the cache, loaded, or
+// read through a mapping.
+uint64_t node_accesses(swap_space &sspace, uint64_t &loads)
+{
+  swap_space::cache_stats stats = sspace.get_cache_stats();
+  loads = stats.misses;
+  return stats.hits + stats.misses + stats.mapped_reads;
+}
+
+enum scan_benchmark { FULL_SCANS, RANGE_SCANS, MIXED_SCANS };
+
+// Scans of a tree loaded with record_count records.  Full scans read
+// the whole tree; range scans read scan_length records from a key
+// drawn from keys, and in the mixed benchmark they alternate at random
+// with upserts of keys from the same distribution.  The values are
+// read as well as the keys.  Nodes touched are the node accesses made
+// by scans (a node visited twice counts twice), and loads are the
+// ones that were not in the cache.  Prints
+//   # scans: <scans> <records> <time> <records/s> <scans/s>
+//   # scan nodes: <nodes touched> <per scan> <loads> <per 1000 records>
+void benchmark_scans(betree<uint64_t, std::string> &b,
+		     swap_space &sspace,
+		     scan_benchmark kind,
+		     uint64_t nops,
+		     key_generator &keys,
+		     uint64_t record_count,
+		     uint64_t value_size,
+		     uint64_t scan_length,
+		     uint64_t random_seed)
+{
+  ycsb_load(b, record_count, value_size, random_seed);
+
+  fast_rng rng(random_seed + 1);
+  value_generator values(value_size, rng);
+  latency_histogram scan_latency, update_latency;
+  uint64_t scans = 0, records = 0, bytes = 0, scan_ns = 0;
+  uint64_t nodes = 0, loads = 0;
+  uint64_t timer = 0;
+  timer_start(timer);
+  for (uint64_t i = 0; i < nops; i++) {
+    uint64_t t = keys.next(rng);
+    if (kind == MIXED_SCANS && rng.uniform(2) == 0) {
+      std::string v = values.next(rng);
+      uint64_t start = monotonic_ns();
+      b.insert(t, v);
+      update_latency.record(monotonic_ns() - start);
+      continue;
+    }
+
+    uint64_t loads_before, loads_after;
+    uint64_t nodes_before = node_accesses(sspace, loads_before);
+    uint64_t start = monotonic_ns();
+    uint64_t length = kind == FULL_SCANS ? UINT64_MAX : scan_length;
+    auto it = kind == FULL_SCANS ? b.begin() : b.lower_bound(t);
+    for (; it != b.end() && length > 0; ++it, --length) {
+      bytes += it.second.size();
+      records++;
+    }
+    uint64_t elapsed = monotonic_ns() - start;
+    scan_latency.record(elapsed);
+    scan_ns += elapsed;
+    scans++;
+    nodes += node_accesses(sspace, loads_after) - nodes_before;
+    loads += loads_after - loads_before;
+  }
+  timer_stop(timer);
+
+  print_latency("scan", scan_latency);
+  if (update_latency.count())
+    print_latency("update", update_latency);
+  printf("# scans: %ld %ld %ld %f %f\n", scans, records, scan_ns / 1000,
+	 scan_ns ? (1.0*records*1000000000)/scan_ns : 0,
+	 scan_ns ? (1.0*scans*1000000000)/scan_ns : 0);
+  printf("# scan nodes: %ld %f %ld %f\n", nodes, scans ? (1.0*nodes)/scans : 0, loads,
+	 records ? (1000.0*nodes)/records : 0);
+  printf("# overall: %ld %ld %f (%ld value bytes)\n", nops, timer,
+	 (1.0*nops*1000000)/timer, bytes);
+}
+
+// Compression ratio of the node images written so far, and the time
+// spent decompressing the ones read back.
+void print_compression_stats(backing_store &store)
+{
+  backing_store::compression_stats stats = store.get_compression_stats();
+  double ratio = stats.stored_bytes ? (1.0*stats.raw_bytes)/stats.stored_bytes : 0;
+  double decode_us = stats.decode_ns/1000.0;
+  printf("# compression: %ld %ld %ld %f\n", stats.images_written, stats.raw_bytes,
+         stats.stored_bytes, ratio);
+  printf("# decode: %ld %f %f\n", stats.images_decoded, decode_us,
+         stats.images_decoded ? decode_us/stats.images_decoded : 0);
+}
+
+// Where the I/O went.  In order, the columns are
+//   cache: hits misses hit_ratio loads_from_memory loads_from_disk
+//          bytes_loaded_from_disk mapped_reads
+//   evictions: clean dirty
+//   nodes: writes bytes_written version_map_writes version_map_bytes
+//   backing_store: reads bytes_read writes bytes_written fsyncs maps
+//                  bytes_mapped deallocations
+//   wal: records bytes_written writes segments_created
+//        segments_recycled manifest_writes
+void print_io_stats(swap_space &sspace, backing_store &store, Logger &logger)
+{
+  swap_space::cache_stats cache = sspace.get_cache_stats();
+  uint64_t accesses = cache.hits + cache.misses;
+  printf("# cache: %ld %ld %f %ld %ld %ld %ld\n", cache.hits, cache.misses,
+         accesses ? (1.0*cache.hits)/accesses : 0, cache.loads_from_memory,
+         cache.loads_from_disk, cache.bytes_loaded_from_disk, cache.mapped_reads);
+  printf("# evictions: %ld %ld\n", cache.clean_evictions, cache.dirty_evictions);
+  printf("# nodes: %ld %ld %ld %ld\n", cache.node_writes, cache.node_bytes_written,
+         cache.version_map_writes, cache.version_map_bytes_written);
+  backing_store::io_stats io = store.get_io_stats();
+  printf("# backing_store: %ld %ld %ld %ld %ld %ld %ld %ld\n", io.reads, io.bytes_read,
+         io.writes, io.bytes_written, io.fsyncs, io.maps, io.bytes_mapped, io.deallocations);
+  Logger::Stats wal = logger.get_stats();
+  printf("# wal: %ld %ld %ld %ld %ld %ld\n", wal.records, wal.bytes_written, wal.writes,
+         wal.segments_created, wal.segments_recycled, wal.manifest_writes);
+}
+
+bool parse_thread_counts(const char *arg, std::vector<unsigned> &counts)
+{
+  counts.clear();
+  std::istringstream in(arg);
+  std::string count;
+  while (std::getline(in, count, ',')) {
+    char *term;
+    unsigned long n = strtoul(count.c_str(), &term, 10);
+    if (count.empty() || *term || n == 0)
+      return false;
+    counts.push_back(n);
+  }
+  return !counts.empty();
+}
+
 int main(int argc, char **argv)
 {
   char *mode = NULL;
   uint64_t max_node_size = DEFAULT_TEST_MAX_NODE_SIZE;
   uint64_t min_flush_size = DEFAULT_TEST_MIN_FLUSH_SIZE;
   uint64_t cache_size = DEFAULT_TEST_CACHE_SIZE;
+  uint64_t image_cache_size = 0;
+  bool compress_images = false;
+  bool fuzzy_checkpoints = false;
+  bool mapped_reads = false;
+  bool direct_io = false;
+  bool use_io_uring = true;
+  bool compress_nodes = false;
+  uint64_t value_log_threshold = 0;
+  uint64_t value_log_segment_size = DEFAULT_VALUE_LOG_SEGMENT_SIZE;
+  bool memory_store = false;
+  uint64_t store_latency_us = 0;
+  uint64_t store_bandwidth_mb = 0;
   char *backing_store_dir = NULL;
   uint64_t number_of_distinct_keys = DEFAULT_TEST_NDISTINCT_KEYS;
   uint64_t nops = DEFAULT_TEST_NOPS;
+  const ycsb_workload *workload = NULL;
+  const char *key_distribution = NULL;
+  std::vector<unsigned> thread_counts;
+  uint64_t value_size = DEFAULT_TEST_VALUE_SIZE;
+  uint64_t max_scan_length = DEFAULT_TEST_MAX_SCAN_LENGTH;
   char *script_infile = NULL;
   char *script_outfile = NULL;
   unsigned int random_seed = time(NULL) * getpid();
  
+  uint64_t checkpoint_granularity = DEFAULT_TEST_CHECKPOINT_GRANULARITY;
   int opt;
   char *term;
-  
-  Logger logger("kv_store.log");
     
   //////////////////////
   // Argument parsing //
   //////////////////////
   
-  while ((opt = getopt(argc, argv, "m:d:N:f:C:o:k:t:s:i:")) != -1) {
+  while ((opt = getopt(argc, argv, "m:d:N:f:C:c:Z:zFMDULV:G:Bl:b:o:k:t:s:i:w:v:S:K:T:")) != -1) {
     switch (opt) {
     case 'm':
       mode = optarg;
@@ -320,6 +882,75 @@ int main(int argc, char **argv)
 	exit(1);
       }
       break;
+    case 'c':
+      checkpoint_granularity = strtoull(optarg, &term, 10);
+      if (*term || checkpoint_granularity == 0) {
+	std::cerr << "Argument to -c must be a positive integer" << std::endl;
+	usage(argv[0]);
+	exit(1);
+      }
+      break;
+    case 'Z':
+      image_cache_size = strtoull(optarg, &term, 10);
+      if (*term) {
+	std::cerr << "Argument to -Z must be an integer" << std::endl;
+	usage(argv[0]);
+	exit(1);
+      }
+      break;
+    case 'z':
+      compress_images = true;
+      break;
+    case 'F':
+      fuzzy_checkpoints = true;
+      break;
+    case 'M':
+      mapped_reads = true;
+      break;
+    case 'D':
+      direct_io = true;
+      break;
+    case 'U':
+      use_io_uring = false;
+      break;
+    case 'L':
+      compress_nodes = true;
+      break;
+    case 'V':
+      value_log_threshold = strtoull(optarg, &term, 10);
+      if (*term) {
+	std::cerr << "Argument to -V must be an integer" << std::endl;
+	usage(argv[0]);
+	exit(1);
+      }
+      break;
+    case 'G':
+      value_log_segment_size = strtoull(optarg, &term, 10);
+      if (*term || value_log_segment_size == 0) {
+	std::cerr << "Argument to -G must be a positive integer" << std::endl;
+	usage(argv[0]);
+	exit(1);
+      }
+      break;
+    case 'B':
+      memory_store = true;
+      break;
+    case 'l':
+      store_latency_us = strtoull(optarg, &term, 10);
+      if (*term) {
+	std::cerr << "Argument to -l must be an integer" << std::endl;
+	usage(argv[0]);
+	exit(1);
+      }
+      break;
+    case 'b':
+      store_bandwidth_mb = strtoull(optarg, &term, 10);
+      if (*term) {
+	std::cerr << "Argument to -b must be an integer" << std::endl;
+	usage(argv[0]);
+	exit(1);
+      }
+      break;
     case 'o':
       script_outfile = optarg;
       break;
@@ -350,6 +981,40 @@ int main(int argc, char **argv)
     case 'i':
       script_infile = optarg;
       break;
+    case 'K':
+      key_distribution = optarg;
+      break;
+    case 'T':
+      if (!parse_thread_counts(optarg, thread_counts)) {
+	std::cerr << "Argument to -T must be a comma separated list of positive integers" << std::endl;
+	usage(argv[0]);
+	exit(1);
+      }
+      break;
+    case 'w':
+      workload = find_ycsb_workload(optarg[0]);
+      if (workload == NULL || optarg[1]) {
+	std::cerr << "Argument to -w must be a workload from a to f" << std::endl;
+	usage(argv[0]);
+	exit(1);
+      }
+      break;
+    case 'v':
+      value_size = strtoull(optarg, &term, 10);
+      if (*term) {
+	std::cerr << "Argument to -v must be an integer" << std::endl;
+	usage(argv[0]);
+	exit(1);
+      }
+      break;
+    case 'S':
+      max_scan_length = strtoull(optarg, &term, 10);
+      if (*term || max_scan_length == 0) {
+	std::cerr << "Argument to -S must be a positive integer" << std::endl;
+	usage(argv[0]);
+	exit(1);
+      }
+      break;
     default:
       std::cerr << "Unknown option '" << (char)opt << "'" << std::endl;
       usage(argv[0]);
@@ -362,13 +1027,26 @@ int main(int argc, char **argv)
 
   if (mode == NULL ||
       (strcmp(mode, "test") != 0
+       && strcmp(mode, "test-value-log") != 0
        && strcmp(mode, "benchmark-upserts") != 0
-			 && strcmp(mode, "benchmark-queries") != 0)) {
+			 && strcmp(mode, "benchmark-queries") != 0
+       && strcmp(mode, "benchmark-ycsb") != 0
+       && strcmp(mode, "benchmark-threads") != 0
+       && strcmp(mode, "benchmark-amplification") != 0
+       && strcmp(mode, "benchmark-full-scans") != 0
+       && strcmp(mode, "benchmark-range-scans") != 0
+       && strcmp(mode, "benchmark-mixed-scans") != 0)) {
     std::cerr << "Must specify a mode of \"test\" or \"benchmark\"" << std::endl;
     usage(argv[0]);
     exit(1);
   }
 
+  if (strcmp(mode, "test-value-log") == 0 && value_log_threshold == 0) {
+    std::cerr << "-V <value_log_threshold> is required for test-value-log" << std::endl;
+    usage(argv[0]);
+    exit(1);
+  }
+
   if (strncmp(mode, "benchmark", strlen("benchmark")) == 0) {
     if (script_infile) {
       std::cerr << "Cannot specify an input script in benchmark mode" << std::endl;
@@ -400,26 +1078,105 @@ int main(int argc, char **argv)
 
   srand(random_seed);
 
-  if (backing_store_dir == NULL) {
+  if ((strcmp(mode, "benchmark-ycsb") == 0 || strcmp(mode, "benchmark-threads") == 0) &&
+      workload == NULL) {
+    std::cerr << "-w <workload> is required for " << mode << std::endl;
+    usage(argv[0]);
+    exit(1);
+  }
+
+  std::unique_ptr<key_generator> keys;
+  if (strncmp(mode, "benchmark", strlen("benchmark")) == 0) {
+    if (key_distribution == NULL)
+      key_distribution = workload ? workload->distribution : "uniform";
+    keys.reset(key_generator::create(key_distribution, number_of_distinct_keys));
+    if (!keys) {
+      std::cerr << "Unknown key distribution \"" << key_distribution << "\"" << std::endl;
+      usage(argv[0]);
+      exit(1);
+    }
+  }
+
+  if (backing_store_dir == NULL && (!memory_store || value_log_threshold)) {
     std::cerr << "-d <backing_store_directory> is required" << std::endl;
     usage(argv[0]);
     exit(1);
   }
+
+  if (!memory_store && (store_latency_us || store_bandwidth_mb)) {
+    std::cerr << "-l and -b are only for the in-memory backing store (-B)" << std::endl;
+    usage(argv[0]);
+    exit(1);
+  }
+
+  // The in-memory store starts out empty, so there is no tree to
+  // recover.
+  struct stat version_map_stat;
+  if (memory_store && stat("version_map.bin", &version_map_stat) == 0 &&
+      version_map_stat.st_size > 0) {
+    std::cerr << "-B needs an empty version_map.bin (try make cleanfiles)" << std::endl;
+    exit(1);
+  }
   
   ////////////////////////////////////////////////////////
   // Construct a betree and run the tests or benchmarks //
   ////////////////////////////////////////////////////////
   
-  one_file_per_object_backing_store ofpobs(backing_store_dir);
-  swap_space sspace(&ofpobs, cache_size);
-  betree<uint64_t, std::string> b(&sspace, max_node_size, max_node_size/4, min_flush_size, logger);
+  Logger logger("kv_store.log", 10, checkpoint_granularity);
+
+  // Both stores live on the stack: their statistics counters are
+  // cache line aligned, which plain new does not guarantee.
+  one_file_per_object_backing_store ofpobs(backing_store_dir ? backing_store_dir : "",
+                                           direct_io && !memory_store, use_io_uring);
+  memory_backing_store mbs(store_latency_us * 1000, store_bandwidth_mb * 1000000);
+  backing_store &store = memory_store ? (backing_store &)mbs : (backing_store &)ofpobs;
+  store.set_compression(compress_nodes);
+  swap_space sspace(&store, cache_size);
+  sspace.set_image_cache_size(image_cache_size, compress_images);
+  sspace.set_mapped_reads(mapped_reads);
+  std::unique_ptr<value_log> vlog;
+  if (value_log_threshold)
+    vlog.reset(new value_log(backing_store_dir, value_log_segment_size));
+  betree<uint64_t, std::string> b(&sspace, max_node_size, max_node_size/4, min_flush_size, logger,
+                                  vlog.get(), value_log_threshold);
+  b.set_fuzzy_checkpoints(fuzzy_checkpoints);
 
   if (strcmp(mode, "test") == 0) 
     test(b, nops, number_of_distinct_keys, script_input, script_output);
+  else if (strcmp(mode, "test-value-log") == 0)
+    test(b, nops, number_of_distinct_keys, script_input, script_output,
+	 std::string(value_size, '.'));
   else if (strcmp(mode, "benchmark-upserts") == 0)
-    benchmark_upserts(b, nops, number_of_distinct_keys, random_seed);
+    benchmark_upserts(b, nops, *keys, random_seed);
   else if (strcmp(mode, "benchmark-queries") == 0)
-    benchmark_queries(b, nops, number_of_distinct_keys, random_seed);
+    benchmark_queries(b, nops, *keys, random_seed);
+  else if (strcmp(mode, "benchmark-ycsb") == 0)
+    benchmark_ycsb(b, *workload, nops, key_distribution, number_of_distinct_keys,
+		   value_size, max_scan_length, random_seed);
+  else if (strcmp(mode, "benchmark-threads") == 0) {
+    if (thread_counts.empty())
+      parse_thread_counts(DEFAULT_TEST_THREAD_COUNTS, thread_counts);
+    benchmark_threads(b, *workload, nops, key_distribution, number_of_distinct_keys,
+		      value_size, max_scan_length, random_seed, thread_counts);
+  }
+  else if (strcmp(mode, "benchmark-amplification") == 0)
+    benchmark_amplification(b, sspace, store, logger, vlog.get(), nops, *keys, value_size,
+			    random_seed, max_node_size, min_flush_size);
+  else if (strcmp(mode, "benchmark-full-scans") == 0)
+    benchmark_scans(b, sspace, FULL_SCANS, nops, *keys, number_of_distinct_keys, value_size,
+		    max_scan_length, random_seed);
+  else if (strcmp(mode, "benchmark-range-scans") == 0)
+    benchmark_scans(b, sspace, RANGE_SCANS, nops, *keys, number_of_distinct_keys, value_size,
+		    max_scan_length, random_seed);
+  else if (strcmp(mode, "benchmark-mixed-scans") == 0)
+    benchmark_scans(b, sspace, MIXED_SCANS, nops, *keys, number_of_distinct_keys, value_size,
+		    max_scan_length, random_seed);
+
+  if (strncmp(mode, "benchmark", strlen("benchmark")) == 0) {
+    if (compress_nodes)
+      print_compression_stats(store);
+    print_io_stats(sspace, store, logger);
+  }
   
   if (script_input)
     fclose(script_input);
@@ -12,6 +12,7 @@
 #include <string.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 // INCLUDE YOUR LOGGING FILE HERE
@@ -84,6 +85,9 @@ void usage(char *name) {
         << "        benchmark modes:" << std::endl
         << "          upserts    " << std::endl
         << "          queries    " << std::endl
+        << "          checkpoints" << std::endl
+        << "          recovery   " << std::endl
+        << "          restart    (checkpoint costs, then recovery time by phase; see -a)" << std::endl
         << "  Betree tuning parameters:" << std::endl
         << "    -N <max_node_size>            (in elements)     [ default: "
         << DEFAULT_TEST_MAX_NODE_SIZE << " ]" << std::endl
@@ -108,7 +112,15 @@ void usage(char *name) {
         << std::endl
         << "  ====REQUIRED PARAMETERS FOR PROJECT 2====" << std::endl
         << "    -p <persistence_granularity>  (an integer)" << std::endl
-        << "    -c <checkpoint_granularity>   (an integer)" << std::endl;
+        << "    -c <checkpoint_granularity>   (an integer)" << std::endl
+        << "    -F                            (fuzzy checkpoints) [ default: off ]"
+        << std::endl
+        << "    -E                            (evict nodes written by a checkpoint) [ default: off ]"
+        << std::endl
+        << "    -V <value_log_threshold>      (in bytes)        [ default: 0 (no value log) ]"
+        << std::endl
+        << "    -a <ops_after_checkpoint>     (for restart)     [ default: 0 ]"
+        << std::endl;
 }
 
 int test(betree<uint64_t, std::string> &b, uint64_t nops,
@@ -205,7 +217,45 @@ void benchmark_queries(betree<uint64_t, std::string> &b, uint64_t nops,
     printf("# overall: %ld %ld\n", nops, overall_timer);
 }
 
-void custom_recovery(uint64_t max_node_size, uint64_t min_flush_size, uint64_t persistence_granularity, uint64_t checkpoint_granularity, one_file_per_object_backing_store ofpobs, uint64_t cache_size) {
+// Runs upserts in windows of a tenth of the checkpoint granularity and
+// compares the window that contains each checkpoint and the window
+// right after it against the rest.  A dip in the "after" windows means
+// the checkpoint left the cache cold.
+void benchmark_checkpoints(betree<uint64_t, std::string> &b, uint64_t nops,
+                           uint64_t number_of_distinct_keys,
+                           uint64_t checkpoint_granularity) {
+    uint64_t window = checkpoint_granularity / 10 > 0 ? checkpoint_granularity / 10 : 1;
+    uint64_t ops[3] = {0, 0, 0};
+    uint64_t timers[3] = {0, 0, 0};
+    const char *names[3] = {"steady", "checkpoint", "after-checkpoint"};
+
+    for (uint64_t done = 0; done + window <= nops; done += window) {
+        uint64_t timer = 0;
+        timer_start(timer);
+        for (uint64_t i = 0; i < window; i++) {
+            uint64_t t = rand() % number_of_distinct_keys;
+            b.update(t, std::to_string(t) + ":");
+        }
+        timer_stop(timer);
+
+        int kind = 0;
+        if ((done + window) / checkpoint_granularity > done / checkpoint_granularity)
+            kind = 1;
+        else if (done > 0 && (done + window - 1) / checkpoint_granularity >
+                                  (done - 1) / checkpoint_granularity)
+            kind = 2;
+        printf("%ld %ld %ld %s\n", done, window, timer, names[kind]);
+        ops[kind] += window;
+        timers[kind] += timer;
+    }
+
+    for (int kind = 0; kind < 3; kind++) {
+        double throughput = timers[kind] ? (1.0 * ops[kind] * 1000000) / timers[kind] : 0;
+        printf("# %s: %ld %ld %f\n", names[kind], ops[kind], timers[kind], throughput);
+    }
+}
+
+void custom_recovery(uint64_t max_node_size, uint64_t min_flush_size, uint64_t persistence_granularity, uint64_t checkpoint_granularity, one_file_per_object_backing_store &ofpobs, uint64_t cache_size) {
     swap_space sspace(&ofpobs, cache_size);
     Logger logger("kv_store.log", persistence_granularity, checkpoint_granularity);
     betree<uint64_t, std::string> tempB(&sspace, max_node_size, max_node_size/4, min_flush_size, logger);
@@ -216,6 +266,184 @@ void custom_recovery(uint64_t max_node_size, uint64_t min_flush_size, uint64_t p
 
 }
 
+// A child process logs nops upserts and dies without a checkpoint or
+// any cleanup (use a -c larger than -t so no checkpoint cuts the log).
+// A second tree is then recovered from the same directory, timing the
+// log parse and the whole recovery, and every key is checked against
+// a std::map.  Start from an empty directory, since the check assumes
+// an empty tree.
+void benchmark_recovery(betree<uint64_t, std::string> &b, Logger &logger,
+                        uint64_t nops, uint64_t number_of_distinct_keys,
+                        uint64_t max_node_size, uint64_t min_flush_size,
+                        one_file_per_object_backing_store &ofpobs,
+                        uint64_t cache_size) {
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        for (uint64_t i = 0; i < nops; i++) {
+            uint64_t t = rand() % number_of_distinct_keys;
+            if (rand() % 10 == 0)
+                b.erase(t);
+            else
+                b.update(t, std::to_string(t) + ":");
+        }
+        logger.flush();
+        _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+
+    // The child started from a copy of our PRNG state, so the same
+    // draws give the same operations.
+    std::map<uint64_t, std::string> reference;
+    for (uint64_t i = 0; i < nops; i++) {
+        uint64_t t = rand() % number_of_distinct_keys;
+        if (rand() % 10 == 0)
+            reference.erase(t);
+        else
+            reference[t] += std::to_string(t) + ":";
+    }
+
+    uint64_t parse_timer = 0;
+    timer_start(parse_timer);
+    size_t nrecords = Logger::read_log("kv_store.log").size();
+    timer_stop(parse_timer);
+
+    uint64_t recovery_timer = 0;
+    uint64_t mismatches = 0;
+    {
+        timer_start(recovery_timer);
+        swap_space sspace(&ofpobs, cache_size);
+        Logger recovered_logger("kv_store.log", 1, UINT64_MAX);
+        betree<uint64_t, std::string> recovered(&sspace, max_node_size, max_node_size / 4,
+                                                min_flush_size, recovered_logger);
+        timer_stop(recovery_timer);
+
+        for (uint64_t t = 0; t < number_of_distinct_keys; t++) {
+            std::string expected = reference.count(t) ? reference[t] : "DNE";
+            std::string actual = "DNE";
+            try {
+                actual = recovered.query(t);
+            } catch (std::out_of_range &e) {
+            }
+            if (expected != actual)
+                mismatches++;
+        }
+    }
+
+    printf("# records: %ld\n", nrecords);
+    printf("# parse: %ld\n", parse_timer);
+    printf("# recovery: %ld %f\n", recovery_timer,
+           recovery_timer ? (1.0 * nrecords * 1000000) / recovery_timer : 0);
+    printf("# mismatches: %ld\n", mismatches);
+
+    // The recovered tree has overwritten node files that b still
+    // refers to, and tearing b down would reload them.
+    fflush(stdout);
+    _exit(mismatches ? 1 : 0);
+}
+
+// count p50 p99 max mean, in microseconds
+void print_histogram(const char *name, const latency_histogram &h) {
+    printf("# %s: %ld %.2f %.2f %.2f %.2f\n", name, h.count(), h.percentile(50) / 1000.0,
+           h.percentile(99) / 1000.0, h.max() / 1000.0, h.mean() / 1000.0);
+}
+
+// A child process builds a tree from the empty directory, loads
+// records 0 to number_of_distinct_keys - 1, runs nops upserts, takes a
+// checkpoint and runs ops_after_checkpoint more upserts, then dies
+// without flushing the log, so like a kill -9 it loses the records
+// still buffered (fewer than -p).  Checkpoints also happen every -c
+// upserts as usual; keep -a below -c, or the last one will not be the
+// forced one.  The child reports checkpoint stalls and durations and
+// the upsert latencies they cause.  A tree is then recovered from the
+// same directory and each phase of recovery timed.  The child builds
+// its own tree because the swap_space threads of one made before the
+// fork do not exist in the child.  Start from an empty directory.
+void benchmark_restart(uint64_t nops, uint64_t number_of_distinct_keys,
+                       uint64_t ops_after_checkpoint, uint64_t max_node_size,
+                       uint64_t min_flush_size, one_file_per_object_backing_store &ofpobs,
+                       uint64_t cache_size, uint64_t persistence_granularity,
+                       uint64_t checkpoint_granularity, bool fuzzy_checkpoints,
+                       bool evict_on_checkpoint, const char *backing_store_dir,
+                       uint64_t value_log_threshold) {
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        std::unique_ptr<value_log> vlog;
+        if (value_log_threshold)
+            vlog.reset(new value_log(backing_store_dir));
+        swap_space sspace(&ofpobs, cache_size);
+        sspace.set_evict_on_checkpoint(evict_on_checkpoint);
+        Logger logger("kv_store.log", persistence_granularity, checkpoint_granularity);
+        betree<uint64_t, std::string> b(&sspace, max_node_size, max_node_size / 4, min_flush_size,
+                                        logger, vlog.get(), value_log_threshold);
+        b.set_fuzzy_checkpoints(fuzzy_checkpoints);
+
+        uint64_t load_timer = 0;
+        timer_start(load_timer);
+        for (uint64_t t = 0; t < number_of_distinct_keys; t++)
+            b.insert(t, std::to_string(t) + ":");
+        timer_stop(load_timer);
+        printf("# load: %ld %ld\n", number_of_distinct_keys, load_timer);
+
+        latency_histogram upserts;
+        uint64_t run_timer = 0;
+        timer_start(run_timer);
+        for (uint64_t i = 0; i < nops; i++) {
+            uint64_t t = rand() % number_of_distinct_keys;
+            uint64_t start = monotonic_ns();
+            b.update(t, std::to_string(t) + ":");
+            upserts.record(monotonic_ns() - start);
+        }
+        timer_stop(run_timer);
+        printf("# run: %ld %ld %f\n", nops, run_timer,
+               run_timer ? (1.0 * nops * 1000000) / run_timer : 0);
+
+        sspace.wait_for_checkpoint();
+        b.checkpoint();
+        sspace.wait_for_checkpoint();
+        for (uint64_t i = 0; i < ops_after_checkpoint; i++) {
+            uint64_t t = rand() % number_of_distinct_keys;
+            b.update(t, std::to_string(t) + ":");
+        }
+
+        betree<uint64_t, std::string>::checkpoint_stats stats = b.get_checkpoint_stats();
+        printf("# checkpoints: %ld\n", stats.checkpoints);
+        print_histogram("checkpoint stall", stats.stall_ns);
+        print_histogram("checkpoint duration", stats.duration_ns);
+        print_histogram("upsert latency", upserts);
+        fflush(stdout);
+        _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+
+    uint64_t recovery_timer = 0;
+    betree<uint64_t, std::string>::recovery_stats stats;
+    {
+        timer_start(recovery_timer);
+        std::unique_ptr<value_log> vlog;
+        if (value_log_threshold)
+            vlog.reset(new value_log(backing_store_dir));
+        swap_space sspace(&ofpobs, cache_size);
+        Logger logger("kv_store.log", 1, UINT64_MAX);
+        betree<uint64_t, std::string> recovered(&sspace, max_node_size, max_node_size / 4,
+                                                min_flush_size, logger, vlog.get(),
+                                                value_log_threshold);
+        timer_stop(recovery_timer);
+        stats = recovered.get_recovery_stats();
+    }
+
+    // total version_map object_map root log_read replay, in microseconds
+    printf("# recovery: %ld %ld %ld %ld %ld %ld\n", recovery_timer, stats.version_map_ns / 1000,
+           stats.object_map_ns / 1000, stats.root_ns / 1000, stats.log_read_ns / 1000,
+           stats.replay_ns / 1000);
+    printf("# replayed: %ld %ld\n", stats.records_read, stats.records_replayed);
+
+    // As in benchmark_recovery, the tree in main must not be torn down.
+    fflush(stdout);
+    _exit(0);
+}
+
 int main(int argc, char **argv) {
     char *mode = NULL;
     uint64_t max_node_size = DEFAULT_TEST_MAX_NODE_SIZE;
@@ -231,6 +459,10 @@ int main(int argc, char **argv) {
     // REQUIRED PARAMETERS FOR PERSISTENCE AND CHECKPOINTING GRANULARITY
     uint64_t persistence_granularity = UINT64_MAX;
     uint64_t checkpoint_granularity = UINT64_MAX;
+    bool fuzzy_checkpoints = false;
+    bool evict_on_checkpoint = false;
+    uint64_t value_log_threshold = 0;
+    uint64_t ops_after_checkpoint = 0;
 
     int opt;
     char *term;
@@ -239,7 +471,7 @@ int main(int argc, char **argv) {
     // Argument parsing //
     //////////////////////
 
-    while ((opt = getopt(argc, argv, "m:d:N:f:C:o:k:t:s:i:p:c:")) != -1) {
+    while ((opt = getopt(argc, argv, "m:d:N:f:C:o:k:t:s:i:p:c:FEV:a:")) != -1) {
         switch (opt) {
             case 'm':
                 mode = optarg;
@@ -327,6 +559,30 @@ int main(int argc, char **argv) {
                     exit(1);
                 }
                 break;
+            case 'F':
+                fuzzy_checkpoints = true;
+                break;
+            case 'E':
+                evict_on_checkpoint = true;
+                break;
+            case 'V':
+                value_log_threshold = strtoull(optarg, &term, 10);
+                if (*term) {
+                    std::cerr << "Argument to -V must be an integer"
+                              << std::endl;
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'a':
+                ops_after_checkpoint = strtoull(optarg, &term, 10);
+                if (*term) {
+                    std::cerr << "Argument to -a must be an integer"
+                              << std::endl;
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
             default:
                 std::cerr << "Unknown option '" << (char)opt << "'"
                           << std::endl;
@@ -356,7 +612,10 @@ int main(int argc, char **argv) {
 
     if (mode == NULL ||
         (strcmp(mode, "test") != 0 && strcmp(mode, "benchmark-upserts") != 0 &&
-         strcmp(mode, "benchmark-queries") != 0 && strcmp(mode, "custom-recovery") != 0)) {
+         strcmp(mode, "benchmark-queries") != 0 &&
+         strcmp(mode, "benchmark-checkpoints") != 0 &&
+         strcmp(mode, "benchmark-recovery") != 0 &&
+         strcmp(mode, "benchmark-restart") != 0 && strcmp(mode, "custom-recovery") != 0)) {
         std::cerr << "Must specify a mode of \"test\" or \"benchmark\""
                   << std::endl;
         usage(argv[0]);
@@ -411,7 +670,13 @@ int main(int argc, char **argv) {
     //ofpobs.reset_ids();
 
     swap_space sspace(&ofpobs, cache_size);
-    betree<uint64_t, std::string> b(&sspace, max_node_size, max_node_size/4, min_flush_size, logger);
+    sspace.set_evict_on_checkpoint(evict_on_checkpoint);
+    std::unique_ptr<value_log> vlog;
+    if (value_log_threshold)
+        vlog.reset(new value_log(backing_store_dir));
+    betree<uint64_t, std::string> b(&sspace, max_node_size, max_node_size/4, min_flush_size, logger,
+                                    vlog.get(), value_log_threshold);
+    b.set_fuzzy_checkpoints(fuzzy_checkpoints);
 
     /**
      * STUDENTS: INITIALIZE YOUR CLASS HERE
@@ -442,6 +707,19 @@ int main(int argc, char **argv) {
         // benchmark_queries(b, nops, number_of_distinct_keys, random_seed);
     }
 
+    else if (strcmp(mode, "benchmark-checkpoints") == 0)
+        benchmark_checkpoints(b, nops, number_of_distinct_keys, checkpoint_granularity);
+
+    else if (strcmp(mode, "benchmark-recovery") == 0)
+        benchmark_recovery(b, logger, nops, number_of_distinct_keys, max_node_size,
+                           min_flush_size, ofpobs, cache_size);
+
+    else if (strcmp(mode, "benchmark-restart") == 0)
+        benchmark_restart(nops, number_of_distinct_keys, ops_after_checkpoint, max_node_size,
+                          min_flush_size, ofpobs, cache_size, persistence_granularity,
+                          checkpoint_granularity, fuzzy_checkpoints, evict_on_checkpoint,
+                          backing_store_dir, value_log_threshold);
+
     else if(strcmp(mode, "custom-recovery") == 0) {
         custom_recovery(max_node_size, min_flush_size, persistence_granularity, checkpoint_granularity, ofpobs, cache_size);
     }
@@ -0,0 +1,237 @@
+#include "value_log.hpp"
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cassert>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+#define VALUE_LOG_PREFIX "vlog."
+#define VALUE_LOG_HEADER_SIZE (2 * sizeof(uint32_t))
+
+static const size_t reference_size = 1 + 3 * sizeof(uint64_t);
+
+static std::string make_reference(uint64_t segment, uint64_t offset, uint64_t length)
+{
+  std::string reference(1, value_log::REFERENCE_TAG);
+  reference.append((const char *)&segment, sizeof(segment));
+  reference.append((const char *)&offset, sizeof(offset));
+  reference.append((const char *)&length, sizeof(length));
+  return reference;
+}
+
+static void parse_reference(const std::string &reference, uint64_t &segment,
+                            uint64_t &offset, uint64_t &length)
+{
+  const char *p = reference.data() + 1;
+  memcpy(&segment, p, sizeof(segment));
+  memcpy(&offset, p + sizeof(segment), sizeof(offset));
+  memcpy(&length, p + sizeof(segment) + sizeof(offset), sizeof(length));
+}
+
+// Segments left by a previous run are sealed; appends always start a
+// new one, since the old head may end in a torn record.
+value_log::value_log(const std::string &dir, uint64_t segment_size) :
+  dir(dir),
+  segment_size(segment_size),
+  head(0),
+  totals()
+{
+  DIR *d = opendir(dir.c_str());
+  assert(d != NULL);
+  struct dirent *entry;
+  while ((entry = readdir(d)) != NULL) {
+    if (strncmp(entry->d_name, VALUE_LOG_PREFIX, strlen(VALUE_LOG_PREFIX)) != 0)
+      continue;
+    uint64_t segment = strtoull(entry->d_name + strlen(VALUE_LOG_PREFIX), NULL, 10);
+    int fd = open(segment_filename(segment).c_str(), O_RDONLY);
+    assert(fd >= 0);
+    off_t size = lseek(fd, 0, SEEK_END);
+    segments[segment] = segment_info{fd, (uint64_t)size, 0, false};
+    head = std::max(head, segment + 1);
+  }
+  closedir(d);
+  std::lock_guard<std::mutex> guard(lock);
+  start_segment();
+}
+
+value_log::~value_log(void)
+{
+  sync();
+  std::lock_guard<std::mutex> guard(lock);
+  for (auto &it : segments)
+    close(it.second.fd);
+}
+
+std::string value_log::segment_filename(uint64_t segment) const
+{
+  return dir + "/" VALUE_LOG_PREFIX + std::to_string(segment);
+}
+
+// Called with lock held.
+void value_log::start_segment(void)
+{
+  if (!segments.empty() && segments.rbegin()->first + 1 == head)
+    unsynced.push_back(head - 1);
+  int fd = open(segment_filename(head).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  assert(fd >= 0);
+  segments[head] = segment_info{fd, 0, 0, false};
+  head++;
+}
+
+std::string value_log::append(const std::string &key, const std::string &value)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  segment_info *seg = &segments.rbegin()->second;
+  uint64_t record_size = VALUE_LOG_HEADER_SIZE + key.size() + value.size();
+  if (seg->size > 0 && seg->size + record_size > segment_size) {
+    start_segment();
+    seg = &segments.rbegin()->second;
+  }
+
+  uint32_t lengths[2] = { (uint32_t)key.size(), (uint32_t)value.size() };
+  std::string record((const char *)lengths, sizeof(lengths));
+  record += key;
+  record += value;
+  ssize_t written = pwrite(seg->fd, record.data(), record.size(), seg->size);
+  assert(written == (ssize_t)record.size());
+
+  uint64_t offset = seg->size + VALUE_LOG_HEADER_SIZE + key.size();
+  seg->size += record.size();
+  totals.bytes_written += record.size();
+  return make_reference(head - 1, offset, value.size());
+}
+
+std::string value_log::make_inline(const std::string &value)
+{
+  std::string stored;
+  stored.reserve(1 + value.size());
+  stored.push_back(INLINE_TAG);
+  stored += value;
+  return stored;
+}
+
+bool value_log::is_reference(const std::string &stored)
+{
+  if (stored.empty() || stored[0] == INLINE_TAG)
+    return false;
+  assert(stored[0] == REFERENCE_TAG && stored.size() == reference_size);
+  return true;
+}
+
+std::string value_log::read(const std::string &reference)
+{
+  uint64_t segment, offset, length;
+  parse_reference(reference, segment, offset, length);
+  int fd;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = segments.find(segment);
+    assert(it != segments.end());
+    fd = it->second.fd;
+    totals.bytes_read += length;
+  }
+  std::string value(length, '\0');
+  ssize_t nread = pread(fd, &value[0], length, offset);
+  assert(nread == (ssize_t)length);
+  return value;
+}
+
+void value_log::sync(void)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  std::vector<uint64_t> sealed;
+  sealed.swap(unsynced);
+  sealed.push_back(head - 1);
+  for (uint64_t segment : sealed) {
+    auto it = segments.find(segment);
+    if (it != segments.end())
+      fdatasync(it->second.fd);
+  }
+}
+
+void value_log::release(const std::string &reference)
+{
+  uint64_t segment, offset, length;
+  parse_reference(reference, segment, offset, length);
+  std::lock_guard<std::mutex> guard(lock);
+  auto it = segments.find(segment);
+  if (it != segments.end())
+    it->second.garbage += length;
+}
+
+bool value_log::pick_victim(uint64_t &segment)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  uint64_t best = 0;
+  for (auto &it : segments) {
+    if (it.first == head - 1 || it.second.retired)
+      continue;
+    if (2 * it.second.garbage >= it.second.size && it.second.garbage > best) {
+      best = it.second.garbage;
+      segment = it.first;
+    }
+  }
+  return best > 0;
+}
+
+void value_log::scan(uint64_t segment,
+                     std::function<void(const std::string &, const std::string &)> f)
+{
+  std::string contents;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    const segment_info &seg = segments.at(segment);
+    contents.resize(seg.size);
+    ssize_t nread = pread(seg.fd, &contents[0], seg.size, 0);
+    assert(nread == (ssize_t)seg.size);
+    totals.bytes_read += seg.size;
+  }
+
+  uint64_t pos = 0;
+  while (pos + VALUE_LOG_HEADER_SIZE <= contents.size()) {
+    uint32_t lengths[2];
+    memcpy(lengths, contents.data() + pos, sizeof(lengths));
+    uint64_t value_offset = pos + VALUE_LOG_HEADER_SIZE + lengths[0];
+    if (value_offset + lengths[1] > contents.size())
+      break;
+    f(contents.substr(pos + VALUE_LOG_HEADER_SIZE, lengths[0]),
+      make_reference(segment, value_offset, lengths[1]));
+    pos = value_offset + lengths[1];
+  }
+}
+
+void value_log::retire(uint64_t segment)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  segments.at(segment).retired = true;
+  retired.push_back(segment);
+}
+
+std::vector<uint64_t> value_log::take_retired(void)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  std::vector<uint64_t> result;
+  result.swap(retired);
+  return result;
+}
+
+void value_log::remove(const std::vector<uint64_t> &doomed)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  for (uint64_t segment : doomed) {
+    auto it = segments.find(segment);
+    if (it == segments.end())
+      continue;
+    close(it->second.fd);
+    unlink(segment_filename(segment).c_str());
+    segments.erase(it);
+  }
+}
+
+value_log::stats value_log::get_stats(void)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  return totals;
+}
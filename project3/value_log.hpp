@@ -0,0 +1,129 @@
+// A log for large values, kept apart from the tree so that they are
+// written once instead of at every level they are flushed through.
+// The tree holds a short reference in their place (see the vlog and
+// value_log_threshold arguments of the betree constructor).
+//
+// The log is a series of segment files, <dir>/vlog.<n>.  A record is
+// a uint32 key length, a uint32 value length, the key bytes (see
+// flat_codec::encode_key) and the value.  Appends go to the newest
+// segment; the rest are sealed.
+//
+// A tree with a value log stores every value with a one-byte tag in
+// front.  INLINE_TAG is followed by the value itself, REFERENCE_TAG by
+// the uint64 segment, offset and length of the value in the log.
+// Updates append to inline values as they are.  A tree must therefore
+// always be opened with a value log or always without one.
+//
+// The tree reports references it drops with release().  A sealed
+// segment that is mostly garbage is picked for collection: the tree
+// copies its live values to the head of the log and retires it, and
+// it is removed once a checkpoint no longer refers to it.  Garbage
+// counts are not persistent, so segments from before a restart are
+// only collected once new garbage in them is seen.
+
+#ifndef VALUE_LOG_HPP
+#define VALUE_LOG_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <functional>
+#include <cassert>
+
+#ifndef DEFAULT_VALUE_LOG_SEGMENT_SIZE
+#define DEFAULT_VALUE_LOG_SEGMENT_SIZE (4ULL << 20)
+#endif
+
+class value_log {
+public:
+  value_log(const std::string &dir, uint64_t segment_size = DEFAULT_VALUE_LOG_SEGMENT_SIZE);
+  ~value_log(void);
+
+  static const char INLINE_TAG = 0;
+  static const char REFERENCE_TAG = 1;
+
+  // Append a value and return the reference to store in its place.
+  std::string append(const std::string &key, const std::string &value);
+  // The stored form of a value kept in the tree.
+  static std::string make_inline(const std::string &value);
+  static bool is_reference(const std::string &stored);
+  std::string read(const std::string &reference);
+
+  // Make every appended value durable.  Checkpoints call this before
+  // writing nodes that may refer to them.
+  void sync(void);
+
+  // The tree no longer refers to this value.
+  void release(const std::string &reference);
+
+  // Garbage collection.  pick_victim() chooses a sealed segment that
+  // is at least half garbage, scan() calls f(key, reference) for each
+  // of its records, and retire() marks it as moved.
+  // take_retired() hands over the segments retired so far; the
+  // caller remove()s them once they are no longer needed.  remove()
+  // may run on another thread.
+  bool pick_victim(uint64_t &segment);
+  void scan(uint64_t segment,
+            std::function<void(const std::string &, const std::string &)> f);
+  void retire(uint64_t segment);
+  std::vector<uint64_t> take_retired(void);
+  void remove(const std::vector<uint64_t> &segments);
+
+  // Bytes moved to and from the segment files so far, including
+  // record headers and garbage collection scans.
+  struct stats {
+    uint64_t bytes_written;
+    uint64_t bytes_read;
+  };
+  stats get_stats(void);
+
+private:
+  struct segment_info {
+    int fd;
+    uint64_t size;
+    uint64_t garbage;
+    bool retired;
+  };
+
+  std::string segment_filename(uint64_t segment) const;
+  void start_segment(void);
+
+  const std::string dir;
+  const uint64_t segment_size;
+  std::map<uint64_t, segment_info> segments;
+  uint64_t head;
+  std::vector<uint64_t> unsynced;  // Sealed since the last sync()
+  std::vector<uint64_t> retired;  // Not yet handed to take_retired()
+  stats totals;
+  std::mutex lock;  // remove() runs on checkpoint threads
+};
+
+// Only std::string values are ever put in a value log, or tagged.
+// For other types these do nothing.
+template<class Value> uint64_t value_log_size(const Value &v) { return 0; }
+template<class Value> bool value_log_refers(const Value &v, const std::string &reference) { return false; }
+template<class Value> bool value_log_is_reference(const Value &v) { return false; }
+template<class Value> Value value_log_inline(const Value &v) { return v; }
+template<class Value> Value value_log_read(value_log &log, const Value &v) { return v; }
+template<class Value> Value value_log_append(value_log &log, const std::string &key, const Value &v) { return v; }
+template<class Value> void value_log_release(value_log &log, const Value &v) {}
+
+inline uint64_t value_log_size(const std::string &v) { return v.size(); }
+inline bool value_log_refers(const std::string &v, const std::string &reference) { return v == reference; }
+inline bool value_log_is_reference(const std::string &v) { return value_log::is_reference(v); }
+inline std::string value_log_inline(const std::string &v) { return value_log::make_inline(v); }
+inline std::string value_log_read(value_log &log, const std::string &v) {
+  assert(!v.empty());
+  return value_log::is_reference(v) ? log.read(v) : v.substr(1);
+}
+inline std::string value_log_append(value_log &log, const std::string &key, const std::string &v) {
+  return log.append(key, v);
+}
+inline void value_log_release(value_log &log, const std::string &v) {
+  if (value_log::is_reference(v))
+    log.release(v);
+}
+
+#endif // VALUE_LOG_HPP